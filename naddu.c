@@ -2,6 +2,7 @@
 /*{{{  includes*/
 
 #define _POSIX_C_SOURCE 200809L
+#define _DEFAULT_SOURCE  // madvise and MADV_HUGEPAGE
 
 #include <stdio.h>
 #include <stdlib.h>
@@ -11,6 +12,21 @@
 #include <assert.h>
 #include <time.h>
 #include <sys/time.h>
+#include <pthread.h>
+#include <strings.h>
+#include <sys/mman.h>
+
+#if defined(__x86_64__) || defined(__i386__)
+#include <x86intrin.h>
+#define HAVE_RDTSC 1
+#endif
+
+#ifdef USE_PEXT
+#ifndef __BMI2__
+#error "USE_PEXT needs -mbmi2 (make PEXT=1)"
+#endif
+#include <immintrin.h>
+#endif
 
 /*}}}*/
 /*{{{  constants*/
@@ -18,8 +34,43 @@
 #define MAX_PLY 128
 #define MAX_MOVES 256
 
-#define UCI_LINE_LENGTH 8192
-#define UCI_TOKENS      8192
+#ifdef USE_PEXT
+#define SLIDER_BACKEND "pext"
+#else
+#define SLIDER_BACKEND "magic"
+#endif
+
+#define BISHOP_TABLE_SIZE 5248
+#define ROOK_TABLE_SIZE   102400
+
+#define MAX_THREADS 256
+
+#define PERFT_TASKS_PER_THREAD 8
+#define PERFT_BUCKET_ENTRIES   4
+
+#define PERFTSUITE_BATCH     256
+#define PERFTSUITE_MAX_DEPTH 16
+
+#define MICROBENCH_POSITIONS 8192
+#define MICROBENCH_REPEATS   9
+
+#define MATE     30000
+#define INFINITE 32000
+
+#define TT_BUCKET_ENTRIES 4
+#define TT_DEFAULT_MB     16
+#define TT_MAX_MB         65536
+#define HUGE_PAGE_SIZE    (2 * 1024 * 1024)
+
+enum {TT_UPPER = 1, TT_LOWER = 2, TT_EXACT = 3};
+
+#define MAX_DEPTH (MAX_PLY / 2)
+
+#define SMP_BENCH_DEPTH 6  // iterative deepening limit, leaves room for extensions and qsearch
+
+#define MOVE_OVERHEAD_MS 50
+
+#define UCI_LINE_LENGTH 8192  // only for built in command lines - stdin lines can be any length
 
 #define WHITE_RIGHTS_KING  1
 #define WHITE_RIGHTS_QUEEN 2
@@ -56,6 +107,25 @@ enum {WHITE, BLACK};
 
 #define MASK_SPECIAL (FLAG_PAWN_PUSH | FLAG_EP_CAPTURE | FLAG_CASTLE | FLAG_PROMO)
 
+// make_move dispatch - the special flag bits shifted down, bit 0 set for a capture
+
+#define KIND_SHIFT 11
+
+enum {
+  KIND_QUIET         = 0,
+  KIND_CAPTURE       = 1,
+  KIND_PUSH          = FLAG_PAWN_PUSH  >> KIND_SHIFT,
+  KIND_EP            = FLAG_EP_CAPTURE >> KIND_SHIFT,
+  KIND_CASTLE        = FLAG_CASTLE     >> KIND_SHIFT,
+  KIND_PROMO         = FLAG_PROMO      >> KIND_SHIFT,
+  KIND_PROMO_CAPTURE = KIND_PROMO | KIND_CAPTURE
+};
+
+// which moves the generators emit - noisy is captures, ep and queen promotions,
+// quiet is everything else including the underpromotions, so the two never overlap
+
+enum {GEN_ALL, GEN_NOISY, GEN_QUIET};
+
 enum {
   A1, B1, C1, D1, E1, F1, G1, H1,
   A2, B2, C2, D2, E2, F2, G2, H2,
@@ -70,18 +140,55 @@ enum {
 /*}}}*/
 /*{{{  macros*/
 
+// hot path counters, compiled in with make BUILD=stats and free otherwise
+
+#ifdef STATS
+#define STAT_INC(name)     (stats.name++)
+#define STAT_MOVES(n)      (stats.num_moves[(n) < MAX_MOVES ? (n) : MAX_MOVES]++)
+#else
+#define STAT_INC(name)     ((void)0)
+#define STAT_MOVES(n)      ((void)0)
+#endif
 
 /*}}}*/
 /*{{{  structs*/
 
 /*{{{  Position struct*/
 
+// the default layout is 6 piece type bitboards and 2 colour bitboards with a byte
+// mailbox - 192 bytes against 256 for make LAYOUT=wide, the original 12 piece
+// bitboards - a nibble mailbox fits in 128 bytes but the read-modify-writes in
+// make_move cost more than the saved copy - only the position accessors look inside
+
+#ifdef WIDE_POSITION
+
 typedef struct {
 
   uint64_t all[12];
   uint64_t colour[2];
   uint64_t occupied;
 
+  uint64_t hash;
+
+  uint8_t board[64];
+
+  uint8_t stm;
+  uint8_t rights;
+  uint8_t ep;
+  uint8_t hmc;
+
+} __attribute__((aligned(64))) Position;
+
+#else
+
+typedef struct {
+
+  uint64_t pieces[6];
+  uint64_t colour[2];
+  uint64_t occupied;
+
+  uint64_t hash;
+
   uint8_t board[64];
 
   uint8_t stm;
@@ -91,6 +198,24 @@ typedef struct {
 
 } __attribute__((aligned(64))) Position;
 
+#endif
+
+/*}}}*/
+/*{{{  Undo struct*/
+
+// what make_move_undo saves so unmake_move can put the position back in place
+
+typedef struct {
+
+  uint64_t hash;
+
+  uint8_t captured;  // piece_index or EMPTY - an ep capture is implied by the move
+  uint8_t rights;
+  uint8_t ep;
+  uint8_t hmc;
+
+} Undo;
+
 /*}}}*/
 /*{{{  Node struct*/
 
@@ -101,26 +226,276 @@ typedef struct {
   uint32_t moves[MAX_MOVES];
   int num_moves;
 
+  uint64_t threats;  // threat_map of pos, left by gen_moves and gen_legal
+
+  Undo undo;
+
 } Node;
 
 /*}}}*/
 /*{{{  Attack struct*/
 
-typedef struct {
+// 32 bytes so a square's lookup data never straddles a cache line
+// the attacks themselves live in slider_table[offset ...]
 
-  int bits;
-  int count;
-  int shift;
+typedef struct {
 
   uint64_t mask;
   uint64_t magic;
 
-  uint64_t *attacks;
+  uint32_t offset;
+  uint32_t shift;
+
+} __attribute__((aligned(32))) Attack;
+
+/*}}}*/
+
+/*{{{  PerftTask struct*/
+
+// a subtree handed to a perft worker thread
+
+typedef struct {
+
+  Position pos;
+
+  int depth;
+  int root;  // index of the root move the subtree hangs from, for divide
+  uint64_t nodes;
+
+} PerftTask;
+
+/*}}}*/
+/*{{{  PerftPool struct*/
+
+typedef struct {
+
+  PerftTask *tasks;
+  int num_tasks;
+
+  int next_task;  // claimed with __atomic_fetch_add
+
+} PerftPool;
+
+/*}}}*/
+/*{{{  PerftEntry struct*/
+
+// key is stored xor data so an entry torn by another thread fails the probe
+// data is nodes << 8 | depth - both words are accessed with relaxed __atomic
+
+typedef struct {
+
+  uint64_t key;
+  uint64_t data;
+
+} PerftEntry;
+
+/*}}}*/
+/*{{{  PerftBucket struct*/
+
+typedef struct {
+
+  PerftEntry entries[PERFT_BUCKET_ENTRIES];
+
+} __attribute__((aligned(64))) PerftBucket;
+
+/*}}}*/
+/*{{{  PerftOpts struct*/
+
+typedef struct {
+
+  int threads;
+  int hash_mb;
+  int legal;    // gen_legal_moves instead of gen_moves + king check of ep and pin candidate moves
+  int bulk;     // with legal, count the moves at depth 1 instead of making them
+  int unmake;   // make_move_undo + unmake_move on one position instead of copy-make
+
+} PerftOpts;
+
+/*}}}*/
+/*{{{  Stats struct*/
+
+// see STAT_INC - counters are plain so use 1 thread for exact numbers
+
+enum {MOVE_QUIET, MOVE_CAPTURE, MOVE_PUSH, MOVE_EP, MOVE_CASTLE, MOVE_PROMO, MOVE_KINDS};
+
+typedef struct {
+
+  uint64_t gen_pawns;
+  uint64_t gen_sliders;
+  uint64_t gen_jumpers;
+  uint64_t gen_castling;
+  uint64_t gen_legal;
+
+  uint64_t make_move[MOVE_KINDS];
+  uint64_t is_attacked;
+
+  uint64_t num_moves[MAX_MOVES + 1];  // per generated node
+
+  uint64_t perft_pseudo;     // pseudo-legal moves made by perft
+  uint64_t perft_tested;     // of which needed the king check (ep and pin candidates)
+  uint64_t perft_rejected;   // of which left the king attacked
+
+} Stats;
+
+/*}}}*/
+/*{{{  SuiteTask struct*/
+
+// one EPD line of a perftsuite run - expected[d] is 0 when ;Dd is not given
+
+typedef struct {
+
+  Position pos;
+
+  int line;
+  int max_depth;
+
+  uint64_t expected[PERFTSUITE_MAX_DEPTH + 1];
+  uint64_t got[PERFTSUITE_MAX_DEPTH + 1];
+
+  uint64_t nodes;
+  double ms;
+
+  char fen[128];
+
+} SuiteTask;
+
+/*}}}*/
+/*{{{  SuitePool struct*/
+
+typedef struct {
+
+  SuiteTask *tasks;
+  int num_tasks;
+
+  int next_task;  // claimed with __atomic_fetch_add
+
+} SuitePool;
+
+/*}}}*/
+/*{{{  MicroCall struct*/
+
+// one call of a microbenchmarked function - the position is copied into
+// a hot Node first and move is 0 for the generators
+
+typedef struct {
+
+  const Position *pos;
+  uint32_t move;
+
+} MicroCall;
+
+/*}}}*/
+/*{{{  UciGame struct*/
+
+// what the last position command left in ss[0].pos - a command with the same
+// base whose move list extends the applied one only needs the new moves
+
+typedef struct {
+
+  char *base;       // "startpos" or the fen fields, space separated
+  char *moves;      // the moves applied so far, space separated
+  int num_moves;
+
+  Position pos;     // ss[0].pos after them, other commands may reuse ss[0]
+
+  uint64_t *hashes; // hashes[i] is the position before move i, for repetitions
+  int max_hashes;
+
+} UciGame;
+
+/*}}}*/
+/*{{{  TTEntry struct*/
+
+// data is move:20 score:16 depth:8 bound:2 age:6 from bit 0 up, never 0 as
+// bound is never 0 - the key is hash ^ data like PerftEntry
+
+typedef struct {
+
+  uint64_t key;
+  uint64_t data;
+
+} TTEntry;
+
+/*}}}*/
+/*{{{  TTBucket struct*/
+
+// a probe touches exactly one cache line
+
+typedef struct {
+
+  TTEntry entries[TT_BUCKET_ENTRIES];
+
+} __attribute__((aligned(64))) TTBucket;
+
+/*}}}*/
+/*{{{  SearchLimits struct*/
+
+// from the go command, 0 means not given
+
+typedef struct {
+
+  int depth;
+  uint64_t nodes;
+  int movetime;
+  int wtime;
+  int btime;
+  int winc;
+  int binc;
+  int movestogo;
+  int infinite;
+
+} SearchLimits;
+
+/*}}}*/
+/*{{{  Search struct*/
+
+// one searching thread - the Node stack is ss for the main search, helpers
+// (lazy smp) have their own and share only the tt and search_stop
+
+typedef struct {
+
+  Node *stack;
+  int id;                         // 0 for the main search
 
-} Attack;
+  uint64_t nodes;
+
+  int pv_len[MAX_PLY];
+  uint32_t pv[MAX_PLY][MAX_PLY];  // triangular, pv[ply] is the line from ply
+
+  uint32_t prev_pv[MAX_PLY];      // last completed iteration's line, tried first
+  int prev_pv_len;
+
+  uint32_t killers[MAX_PLY][2];   // quiet moves that caused a beta cutoff at this ply
+
+  uint32_t best_move;
+  int best_score;
+  int depth;                      // last completed iteration
+
+} Search;
 
 /*}}}*/
+/*{{{  MovePicker struct*/
+
+// one search node's staged move ordering - the hash move and the killers are
+// tried before anything is generated, then the noisy moves by mvv-lva, then the
+// quiets, which are never generated at all when an earlier move cuts off
+
+enum {STAGE_HASH, STAGE_GEN_NOISY, STAGE_NOISY, STAGE_KILLERS, STAGE_GEN_QUIET, STAGE_QUIET, STAGE_DONE};
+
+typedef struct {
+
+  int stage;
+  int index;                 // next move in node->moves, or next killer
+  int pseudo;                // the last move returned was only checked as pseudo legal
+
+  uint32_t hash_move;
+  uint32_t killers[2];
+
+  int scores[MAX_MOVES];
 
+} MovePicker;
+
+/*}}}*/
 /*{{{  Perft*/
 
 typedef struct {
@@ -139,12 +514,100 @@ typedef struct {
 
 static uint64_t pawn_attacks[2][64];
 static uint64_t knight_attacks[64];
-static Attack   bishop_attacks[64];
-static Attack   rook_attacks[64];
+static Attack   bishop_attacks[64] __attribute__((aligned(64)));
+static Attack   rook_attacks[64] __attribute__((aligned(64)));
 static uint64_t king_attacks[64];
 
+static uint64_t between_table[64][64];  // squares strictly between two squares on a line, else 0
+static uint64_t line_table[64][64];     // the whole line through both, else 0
+
+// every bishop then rook attack set, one arena instead of a malloc per square
+
+static uint64_t slider_table[BISHOP_TABLE_SIZE + ROOK_TABLE_SIZE] __attribute__((aligned(64)));
+
+static uint64_t zob_pieces[12][64];
+static uint64_t zob_rights[16];
+static uint64_t zob_ep[64];  // zob_ep[0] is 0 so no ep needs no special case
+static uint64_t zob_stm;
+
+/*{{{  magics*/
+
+// found with the findmagics command, which prints tables in this format
+
+static const uint64_t bishop_magics[64] = {
+  0x0018911026004900ULL, 0x0020080106408600ULL, 0x0024282600400220ULL, 0x0c04104208021041ULL,
+  0x1008484040000003ULL, 0x000202100420c800ULL, 0x8200808820500301ULL, 0x8010108815082000ULL,
+  0x0000081004080041ULL, 0x0040100108410040ULL, 0xa006702082124800ULL, 0x0080140400814202ULL,
+  0x1080111140048000ULL, 0x0010008220200080ULL, 0x0000004104104288ULL, 0x800201045a1e2000ULL,
+  0xa632002002020800ULL, 0x0002821410020620ULL, 0x1002000104040082ULL, 0x0344041824001020ULL,
+  0x110c800400a01000ULL, 0x0101080200822010ULL, 0x000200c508024240ULL, 0x5211000021191000ULL,
+  0x0010084010604140ULL, 0x0008200908118100ULL, 0x0140208004080080ULL, 0x00c80800108a0060ULL,
+  0x0c81010100104000ULL, 0x8001120009008088ULL, 0x608b0049441e0804ULL, 0x0844008040404c00ULL,
+  0x001006f040200400ULL, 0x808802a840020814ULL, 0x1005402800100040ULL, 0x0089e08400080210ULL,
+  0x2028020400001010ULL, 0x2020808602210100ULL, 0x200408048d0a0080ULL, 0x0001010100202400ULL,
+  0x2608021090000400ULL, 0x0022080208012200ULL, 0x001e010402100100ULL, 0x8040122018012108ULL,
+  0x0000080104000841ULL, 0x04440804880a2100ULL, 0x40082200a2200400ULL, 0x0001010408840108ULL,
+  0x9301808431401008ULL, 0x4709128a10060080ULL, 0x0004020a11140000ULL, 0x110000a020880035ULL,
+  0x1080102020c30200ULL, 0x0021a06022008000ULL, 0x8060604102148001ULL, 0x0060480651806003ULL,
+  0x0101618a01904002ULL, 0x8a00003082082023ULL, 0x2020120100511000ULL, 0x01860001a2208800ULL,
+  0x0010001011a02200ULL, 0x10a0100604080e07ULL, 0x1040080810008200ULL, 0x9022101001004c84ULL
+};
+
+static const uint64_t rook_magics[64] = {
+  0x2080001620400080ULL, 0x0540004010002008ULL, 0x0080200010008008ULL, 0x0100082010000502ULL,
+  0x0480040002800800ULL, 0x8880140012008001ULL, 0x0a800a0001004080ULL, 0x8200022213048044ULL,
+  0x0824800040003082ULL, 0x0012002041020094ULL, 0x5002801000a00080ULL, 0x8802002012000b40ULL,
+  0x0000800400800800ULL, 0x0002808004000200ULL, 0x2401010401000200ULL, 0x08c0802080004100ULL,
+  0x2180014000402000ULL, 0x0110004000402010ULL, 0x0000410010200109ULL, 0x0008008008100080ULL,
+  0x4004008008000481ULL, 0x8104008002008004ULL, 0x4000040008820150ULL, 0x0000020000440081ULL,
+  0x1000800080204002ULL, 0x0040008100310040ULL, 0x0208104200220080ULL, 0x2100100100210008ULL,
+  0x2280110100080004ULL, 0x8000020080040080ULL, 0x9800888400100102ULL, 0x0000802080004100ULL,
+  0x2020004000808000ULL, 0x0823c02002401000ULL, 0x1611004011002001ULL, 0x0000081001002100ULL,
+  0x1010080080800400ULL, 0x8000040080800200ULL, 0x0300100204008801ULL, 0x2812050486000044ULL,
+  0x2000814000218005ULL, 0x0410002000404000ULL, 0x3810004020010100ULL, 0x2001001000210008ULL,
+  0x2048000400088080ULL, 0x8000040002008080ULL, 0x0800020001008080ULL, 0x0180208400520021ULL,
+  0x0080448001002300ULL, 0x4204804001002500ULL, 0x014120118a420200ULL, 0x0100080080100080ULL,
+  0x9008000804008080ULL, 0x1000040080020080ULL, 0x1284280230010400ULL, 0x0804110084204200ULL,
+  0x00891303c1208202ULL, 0x0411001040008025ULL, 0x4011005040a0004dULL, 0x0102001020080442ULL,
+  0x4102000810200402ULL, 0x0282000448011062ULL, 0x0008008228100144ULL, 0x0a000c0085005022ULL
+};
+
+/*}}}*/
+
 static Node ss[MAX_PLY];
 
+static int exit_code = 0;  // returned from main, set when a perftsuite or bench fails
+
+#ifdef STATS
+static Stats stats;
+#endif
+
+static PerftBucket *perft_table = NULL;
+static uint64_t     perft_table_mask = 0;
+static int          perft_table_mb = 0;
+
+static PerftOpts perft_opts = {1, 0, 1, 1, 0};
+
+static UciGame uci_game;
+
+static TTBucket *tt_table = NULL;
+static uint64_t  tt_mask = 0;
+static int       tt_mb = 0;
+static int       tt_age = 0;  // bumped by each go, 6 bits
+
+static SearchLimits search_limits;
+static Search       search_main;
+static Search      *search_helpers = NULL;  // search_threads-1 of them
+static int          search_threads = 1;
+static int          search_quiet = 0;       // no info or bestmove, for the smp bench
+static pthread_t    search_thread;
+static int          search_running = 0;
+static int          search_stop = 0;     // set by stop, quit or the limits - accessed with __atomic
+static double       search_start_ms = 0;
+static double       search_soft_ms = 0;  // no new iteration after this, 0 is no limit
+static double       search_hard_ms = 0;  // abandon the iteration after this, 0 is no limit
+static int          search_history = 0;  // uci_game.hashes before ss[0] that repetitions can see
+
 /*{{{  perft fens*/
 
 static const Perft perft_tests[] = {
@@ -216,6 +679,28 @@ static const Perft perft_tests[] = {
 
 };
 
+/*}}}*/
+/*{{{  bench fens*/
+
+// fixed workload for the bench command - the total node count is the signature
+// and must not change unless these entries do
+
+#define BENCH_SIGNATURE 49973236ULL
+
+static const Perft bench_tests[] = {
+
+  {"p f rnbqkbnr/pppppppp/8/8/8/8/PPPPPPPP/RNBQKBNR                   w KQkq -  0 1",  5, 4865609,  "cpw-pos1"},
+  {"p f r3k2r/p1ppqpb1/bn2pnp1/3PN3/1p2P3/2N2Q1p/PPPBBPPP/R3K2R       w KQkq -  0 1",  4, 4085603,  "cpw-pos2"},
+  {"p f 8/2p5/3p4/KP5r/1R3p1k/8/4P1P1/8                               w -    -  0 1",  6, 11030083, "cpw-pos3"},
+  {"p f r3k2r/Pppp1ppp/1b3nbN/nP6/BBP1P3/q4N2/Pp1P2PP/R2Q1RK1         w kq   -  0 1",  5, 15833292, "cpw-pos4"},
+  {"p f rnbq1k1r/pp1Pbppp/2p5/8/2B5/8/PPP1NnPP/RNBQK2R                w KQ   -  1 8",  4, 2103487,  "cpw-pos5"},
+  {"p f r4rk1/1pp1qppp/p1np1n2/2b1p1B1/2B1P1b1/P1NP1N2/1PP1QPPP/R4RK1 w -    -  0 10", 4, 3894594,  "cpw-pos6"},
+  {"p f 8/8/1k6/2b5/2pP4/8/5K2/8                                      b -    d3 0 1",  6, 1440467,  "ccc-3"},
+  {"p f n1n5/PPPk4/8/8/8/8/4Kppp/5N1N                                 b -    -  0 1",  5, 3605103,  "prom-1"},
+  {"p f 8/8/2k5/5q2/5n2/8/5K2/8                                       b -    -  0 1",  6, 3114998,  "ccc-25"}
+
+};
+
 
 /*}}}*/
 
@@ -296,12 +781,17 @@ static uint64_t xorshift64star(void) {
 
 static void cleanup() {
 
-  for (int sq = 0; sq < 64; sq++) {
+  free(perft_table);
+  free(tt_table);
 
-    free(rook_attacks[sq].attacks);
-    free(bishop_attacks[sq].attacks);
+  for (int i=0; i < search_threads - 1; i++)
+    free(search_helpers[i].stack);
 
-  }
+  free(search_helpers);
+
+  free(uci_game.base);
+  free(uci_game.moves);
+  free(uci_game.hashes);
 
 }
 
@@ -314,6 +804,84 @@ static inline __attribute__((always_inline)) int piece_index(const int piece, co
 
 }
 
+/*}}}*/
+/*{{{  position accessors*/
+
+/*{{{  piece_bb*/
+
+static inline __attribute__((always_inline)) uint64_t piece_bb(const Position *pos, const int piece, const int colour) {
+
+#ifdef WIDE_POSITION
+  return pos->all[piece_index(piece, colour)];
+#else
+  return pos->pieces[piece] & pos->colour[colour];
+#endif
+
+}
+
+/*}}}*/
+/*{{{  type_bb*/
+
+// both colours
+
+static inline __attribute__((always_inline)) uint64_t type_bb(const Position *pos, const int piece) {
+
+#ifdef WIDE_POSITION
+  return pos->all[piece] | pos->all[piece + 6];
+#else
+  return pos->pieces[piece];
+#endif
+
+}
+
+/*}}}*/
+/*{{{  occupancy*/
+
+static inline __attribute__((always_inline)) uint64_t occupancy(const Position *pos) {
+
+  return pos->occupied;
+
+}
+
+/*}}}*/
+/*{{{  piece_on*/
+
+// piece_index or EMPTY
+
+static inline __attribute__((always_inline)) int piece_on(const Position *pos, const int sq) {
+
+  return pos->board[sq];
+
+}
+
+/*}}}*/
+/*{{{  set_piece_on*/
+
+static inline __attribute__((always_inline)) void set_piece_on(Position *pos, const int sq, const int index) {
+
+  pos->board[sq] = index;
+
+}
+
+/*}}}*/
+/*{{{  toggle_piece*/
+
+// add or remove piece on the squares in bb - the mailbox and occupancy are left alone
+
+static inline __attribute__((always_inline)) void toggle_piece(Position *pos, const int piece, const int colour, const uint64_t bb) {
+
+#ifdef WIDE_POSITION
+  pos->all[piece_index(piece, colour)] ^= bb;
+#else
+  pos->pieces[piece] ^= bb;
+#endif
+
+  pos->colour[colour] ^= bb;
+
+}
+
+/*}}}*/
+
 /*}}}*/
 /*{{{  toggle*/
 
@@ -379,16 +947,43 @@ static void pp_move(const uint32_t move) {
 }
 
 /*}}}*/
-/*{{{  print_board*/
+/*{{{  format_move*/
 
-static void print_board(const Position *pos) {
+// uci notation, buf needs 6 chars
 
-  const char piece_chars[12] = {
-    'P', 'N', 'B', 'R', 'Q', 'K',
-    'p', 'n', 'b', 'r', 'q', 'k'
-  };
+static void format_move(const uint32_t move, char *buf) {
 
-  for (int rank = 7; rank >= 0; rank--) {
+  const char files[] = "abcdefgh";
+  const char ranks[] = "12345678";
+  const char promos[] = "nbrq";
+
+  const int from = (move >> 6) & 0x3F;
+  const int to   = move & 0x3F;
+
+  buf[0] = files[from % 8];
+  buf[1] = ranks[from / 8];
+  buf[2] = files[to % 8];
+  buf[3] = ranks[to / 8];
+  buf[4] = '\0';
+
+  if (move & FLAG_PROMO) {
+    buf[4] = promos[(move >> PROMO_SHIFT) & 3];
+    buf[5] = '\0';
+  }
+
+}
+
+/*}}}*/
+/*{{{  print_board*/
+
+static void print_board(const Position *pos) {
+
+  const char piece_chars[12] = {
+    'P', 'N', 'B', 'R', 'Q', 'K',
+    'p', 'n', 'b', 'r', 'q', 'k'
+  };
+
+  for (int rank = 7; rank >= 0; rank--) {
 
     printf("%d  ", rank + 1);
 
@@ -398,12 +993,8 @@ static void print_board(const Position *pos) {
       uint64_t bb = 1ULL << sq;
       char c = '.';
 
-      for (int i = 0; i < 12; i++) {
-        if (pos->all[i] & bb) {
-          c = piece_chars[i];
-          break;
-        }
-      }
+      if (occupancy(pos) & bb)
+        c = piece_chars[piece_on(pos, sq)];
 
       printf("%c ", c);
     }
@@ -413,6 +1004,7 @@ static void print_board(const Position *pos) {
 
   printf("   a b c d e f g h\n");
   printf("ep=%d\n", pos->ep);
+  printf("hash=%016llx\n", (unsigned long long)pos->hash);
 
 }
 
@@ -426,27 +1018,52 @@ static inline __attribute__((always_inline)) int magic_index(const uint64_t bloc
 
 }
 
+/*}}}*/
+/*{{{  slider_index*/
+
+// with pext the index is collision free and the magic and shift are unused
+// both backends use the same table sizes and offsets
+
+static inline __attribute__((always_inline)) uint32_t slider_index(const Attack *a, const uint64_t occupied) {
+
+#ifdef USE_PEXT
+  return a->offset + (uint32_t)_pext_u64(occupied, a->mask);
+#else
+  return a->offset + magic_index(occupied & a->mask, a->magic, a->shift);
+#endif
+
+}
+
+/*}}}*/
+/*{{{  slider_attacks*/
+
+static inline __attribute__((always_inline)) uint64_t slider_attacks(const Attack *a, const uint64_t occupied) {
+
+  return slider_table[slider_index(a, occupied)];
+
+}
+
 /*}}}*/
 /*{{{  get_blockers*/
 
-static void get_blockers(Attack *a, uint64_t *blockers) {
+// every subset of mask, blockers[] must have room for 1 << popcount(mask)
+
+static void get_blockers(const uint64_t mask, uint64_t *blockers) {
 
   int bits[64];
   int num_bits = 0;
 
   for (int b = 0; b < 64; b++) {
-    if (a->mask & (1ULL << b)) {
+    if (mask & (1ULL << b)) {
       bits[num_bits++] = b;
     }
   }
 
-  assert(a->bits == num_bits && "wrong bits");
-
-  for (int i = 0; i < a->count; i++) {
+  for (int i = 0; i < (1 << num_bits); i++) {
 
     uint64_t blocker = 0;
 
-    for (int j = 0; j < a->bits; j++) {
+    for (int j = 0; j < num_bits; j++) {
       if (i & (1 << j)) {
         blocker |= 1ULL << bits[j];
       }
@@ -457,22 +1074,122 @@ static void get_blockers(Attack *a, uint64_t *blockers) {
   }
 }
 
+/*}}}*/
+/*{{{  bishop_ray_attacks*/
+
+// slow ray walk used to build the tables and check magics
+
+static uint64_t bishop_ray_attacks(const int sq, const uint64_t blocker) {
+
+  const int rank = sq / 8;
+  const int file = sq % 8;
+
+  uint64_t attack = 0;
+
+  for (int r = rank + 1, f = file + 1; r <= 7 && f <= 7; r++, f++) {
+    int s = r * 8 + f;
+    attack |= 1ULL << s;
+    if (blocker & (1ULL << s))
+      break;
+  }
+
+  for (int r = rank + 1, f = file - 1; r <= 7 && f >= 0; r++, f--) {
+    int s = r * 8 + f;
+    attack |= 1ULL << s;
+    if (blocker & (1ULL << s))
+      break;
+  }
+
+  for (int r = rank - 1, f = file + 1; r >= 0 && f <= 7; r--, f++) {
+    int s = r * 8 + f;
+    attack |= 1ULL << s;
+    if (blocker & (1ULL << s))
+      break;
+  }
+
+  for (int r = rank - 1, f = file - 1; r >= 0 && f >= 0; r--, f--) {
+    int s = r * 8 + f;
+    attack |= 1ULL << s;
+    if (blocker & (1ULL << s))
+      break;
+  }
+
+  return attack;
+
+}
+
+/*}}}*/
+/*{{{  rook_ray_attacks*/
+
+static uint64_t rook_ray_attacks(const int sq, const uint64_t blocker) {
+
+  const int rank = sq / 8;
+  const int file = sq % 8;
+
+  uint64_t attack = 0;
+
+  for (int r = rank + 1; r <= 7; r++) {
+    int s = r * 8 + file;
+    attack |= 1ULL << s;
+    if (blocker & (1ULL << s)) {
+      break;
+    }
+  }
+
+  for (int r = rank - 1; r >= 0; r--) {
+    int s = r * 8 + file;
+    attack |= 1ULL << s;
+    if (blocker & (1ULL << s)) {
+      break;
+    }
+  }
+
+  for (int f = file + 1; f <= 7; f++) {
+    int s = rank * 8 + f;
+    attack |= 1ULL << s;
+    if (blocker & (1ULL << s)) {
+      break;
+    }
+  }
+
+  for (int f = file - 1; f >= 0; f--) {
+    int s = rank * 8 + f;
+    attack |= 1ULL << s;
+    if (blocker & (1ULL << s)) {
+      break;
+    }
+  }
+
+  return attack;
+
+}
+
 /*}}}*/
 /*{{{  find_magics*/
 
-static void find_magics(Attack attacks[64], const char *label) {
+// trial and error search for a new set of magics - the findmagics command
+// the tables are rebuilt with them (magic backend only) and printed for pasting over the shipped ones
+
+static void find_magics(Attack attacks[64], const char *name, uint64_t (*ray_attacks)(int, uint64_t)) {
 
   int total_tries = 0;
 
-  printf("\n%-2s %3s %12s %5s  %-18s %6s\n", "T", "Sq", "Tries", "Bits", "Magic", "Fill");
-  printf("---------------------------------------------------------------\n");
+  printf("static const uint64_t %s_magics[64] = {\n", name);
 
   for (int sq = 0; sq < 64; sq++) {
 
     Attack *a = &attacks[sq];
 
-    uint64_t blockers[a->count];
-    get_blockers(a, blockers);
+    const int bits  = popcount(a->mask);
+    const int count = 1 << bits;
+
+    uint64_t blockers[count];
+    uint64_t reference[count];
+
+    get_blockers(a->mask, blockers);
+
+    for (int i = 0; i < count; i++)
+      reference[i] = ray_attacks(sq, blockers[i]);
 
     int tries = 0;
 
@@ -482,42 +1199,40 @@ static void find_magics(Attack attacks[64], const char *label) {
 
       uint64_t magic = xorshift64star() & xorshift64star() & xorshift64star();
 
-      if (popcount((a->mask * magic) >> (64 - a->bits)) < a->bits - 2)
+      if (popcount((a->mask * magic) >> (64 - bits)) < bits - 2)
         continue;
 
-      uint64_t *attacks = calloc(a->count, sizeof(uint64_t));
-      if (!attacks) {
-        fprintf(stderr, "calloc failed for attacks[%d]\n", sq);
+      uint64_t *table = calloc(count, sizeof(uint64_t));
+      if (!table) {
+        fprintf(stderr, "calloc failed for %s attacks[%d]\n", name, sq);
         exit(1);
       }
 
-      int fail = 0, populated = 0;
+      int fail = 0;
 
-      for (int i = 0; i < a->count; i++) {
-        uint64_t blocker = blockers[i];
-        uint64_t attack = a->attacks[i];
-        int index = magic_index(blocker, magic, a->shift);
+      for (int i = 0; i < count; i++) {
+        uint64_t attack = reference[i];
+        int index = magic_index(blockers[i], magic, a->shift);
 
-        if (attacks[index] == 0) {
-          attacks[index] = attack;
-          populated++;
+        if (table[index] == 0) {
+          table[index] = attack;
         }
 
-        else if (attacks[index] != attack) {
+        else if (table[index] != attack) {
           fail = 1;
-          free(attacks);
+          free(table);
           break;
         }
       }
 
       if (!fail) {
         a->magic = magic;
-        free(a->attacks);
-        a->attacks = attacks;
+#ifndef USE_PEXT
+        memcpy(&slider_table[a->offset], table, count * sizeof(uint64_t));
+#endif
+        free(table);
 
-        int percent = (100 * populated) / a->count;
-        printf("%-2s %3d %12d %5d  0x%016llx %5d%%\n",
-               label, sq, tries, a->bits, (unsigned long long)magic, percent);
+        printf("%s0x%016llxULL%s", sq % 4 == 0 ? "  " : "", (unsigned long long)magic, sq == 63 ? "\n" : sq % 4 == 3 ? ",\n" : ", ");
 
         total_tries += tries;
         break;
@@ -525,8 +1240,7 @@ static void find_magics(Attack attacks[64], const char *label) {
     }
   }
 
-  printf("---------------------------------------------------------------\n");
-  printf("Total tries for %s: %d\n\n", label, total_tries);
+  printf("};  // %d tries\n\n", total_tries);
 
 }
 
@@ -575,6 +1289,44 @@ static void init_knight_attacks(void) {
   }
 }
 
+/*}}}*/
+/*{{{  init_slider_attacks*/
+
+// lay each square's table out in slider_table from offset on and fill it
+// at the shipped magic indices
+
+static void init_slider_attacks(Attack attacks[64], const uint64_t magics[64], uint64_t (*ray_attacks)(int, uint64_t), uint32_t offset) {
+
+  for (int sq = 0; sq < 64; sq++) {
+
+    Attack *a = &attacks[sq];
+
+    const int bits  = popcount(a->mask);
+    const int count = 1 << bits;
+
+    a->shift  = 64 - bits;
+    a->magic  = magics[sq];
+    a->offset = offset;
+
+    uint64_t blockers[count];
+    get_blockers(a->mask, blockers);
+
+    for (int i = 0; i < count; i++) {
+
+      const uint64_t attack = ray_attacks(sq, blockers[i]);
+      const uint32_t index = slider_index(a, blockers[i]);
+
+      assert((slider_table[index] == 0 || slider_table[index] == attack) && "bad magic");
+
+      slider_table[index] = attack;
+
+    }
+
+    offset += count;
+
+  }
+}
+
 /*}}}*/
 /*{{{  init_bishop_attacks*/
 
@@ -605,61 +1357,9 @@ static void init_bishop_attacks(void) {
     
     /*}}}*/
 
-    a->bits = popcount(a->mask);
-    a->shift = 64 - a->bits;
-    a->count = 1 << a->bits;
-
-    a->attacks = malloc(a->count * sizeof(uint64_t));
-    if (!a->attacks) {
-      fprintf(stderr, "malloc failed for bishop_attacks[%d]\n", sq);
-      cleanup();
-      exit(1);
-    }
-
-    uint64_t blockers[a->count];
-    get_blockers(a, blockers);
-
-    for (int i = 0; i < a->count; i++) {
-      /*{{{  build attacks[i]*/
-      
-      uint64_t blocker = blockers[i];
-      uint64_t attack = 0;
-      
-      for (int r = rank + 1, f = file + 1; r <= 7 && f <= 7; r++, f++) {
-        int s = r * 8 + f;
-        attack |= 1ULL << s;
-        if (blocker & (1ULL << s))
-          break;
-      }
-      
-      for (int r = rank + 1, f = file - 1; r <= 7 && f >= 0; r++, f--) {
-        int s = r * 8 + f;
-        attack |= 1ULL << s;
-        if (blocker & (1ULL << s))
-          break;
-      }
-      
-      for (int r = rank - 1, f = file + 1; r >= 0 && f <= 7; r--, f++) {
-        int s = r * 8 + f;
-        attack |= 1ULL << s;
-        if (blocker & (1ULL << s))
-          break;
-      }
-      
-      for (int r = rank - 1, f = file - 1; r >= 0 && f >= 0; r--, f--) {
-        int s = r * 8 + f;
-        attack |= 1ULL << s;
-        if (blocker & (1ULL << s))
-          break;
-      }
-      
-      a->attacks[i] = attack;
-      
-      /*}}}*/
-    }
   }
 
-  find_magics(bishop_attacks, "B");
+  init_slider_attacks(bishop_attacks, bishop_magics, bishop_ray_attacks, 0);
 
 }
 
@@ -693,65 +1393,9 @@ static void init_rook_attacks(void) {
     
     /*}}}*/
 
-    a->bits = popcount(a->mask);
-    a->shift = 64 - a->bits;
-    a->count = 1 << a->bits;
-
-    a->attacks = malloc(a->count * sizeof(uint64_t));
-    if (!a->attacks) {
-      fprintf(stderr, "malloc failed for attacks[%d]\n", sq);
-      cleanup();
-      exit(1);
-    }
-
-    uint64_t blockers[a->count];
-    get_blockers(a, blockers);
-
-    for (int i = 0; i < a->count; i++) {
-      /*{{{  build attacks[i]*/
-      
-      uint64_t blocker = blockers[i];
-      uint64_t attack = 0;
-      
-      for (int r = rank + 1; r <= 7; r++) {
-        int s = r * 8 + file;
-        attack |= 1ULL << s;
-        if (blocker & (1ULL << s)) {
-          break;
-        }
-      }
-      
-      for (int r = rank - 1; r >= 0; r--) {
-        int s = r * 8 + file;
-        attack |= 1ULL << s;
-        if (blocker & (1ULL << s)) {
-          break;
-        }
-      }
-      
-      for (int f = file + 1; f <= 7; f++) {
-        int s = rank * 8 + f;
-        attack |= 1ULL << s;
-        if (blocker & (1ULL << s)) {
-          break;
-        }
-      }
-      
-      for (int f = file - 1; f >= 0; f--) {
-        int s = rank * 8 + f;
-        attack |= 1ULL << s;
-        if (blocker & (1ULL << s)) {
-          break;
-        }
-      }
-      
-      a->attacks[i] = attack;
-      
-      /*}}}*/
-    }
   }
 
-  find_magics(rook_attacks, "R");
+  init_slider_attacks(rook_attacks, rook_magics, rook_ray_attacks, BISHOP_TABLE_SIZE);
 
 }
 
@@ -780,7 +1424,86 @@ static void init_king_attacks(void) {
 }
 
 /*}}}*/
+/*{{{  init_lines*/
+
+// after the sliders - the two lookups from a and b only see each other, so only
+// the ray joining them survives the intersection
+
+static void init_lines(void) {
+
+  for (int a = 0; a < 64; a++) {
+    for (int b = 0; b < 64; b++) {
+
+      const uint64_t a_bb = 1ULL << a;
+      const uint64_t b_bb = 1ULL << b;
+
+      between_table[a][b] = 0;
+      line_table[a][b]    = 0;
+
+      if (a == b)
+        continue;
+
+      if (slider_attacks(&bishop_attacks[a], 0) & b_bb) {
+        between_table[a][b] = slider_attacks(&bishop_attacks[a], b_bb) & slider_attacks(&bishop_attacks[b], a_bb);
+        line_table[a][b]    = (slider_attacks(&bishop_attacks[a], 0) & slider_attacks(&bishop_attacks[b], 0)) | a_bb | b_bb;
+      }
+
+      else if (slider_attacks(&rook_attacks[a], 0) & b_bb) {
+        between_table[a][b] = slider_attacks(&rook_attacks[a], b_bb) & slider_attacks(&rook_attacks[b], a_bb);
+        line_table[a][b]    = (slider_attacks(&rook_attacks[a], 0) & slider_attacks(&rook_attacks[b], 0)) | a_bb | b_bb;
+      }
+    }
+  }
+}
+
+/*}}}*/
+
+/*{{{  init_zobrist*/
+
+static void init_zobrist(void) {
+
+  for (int p = 0; p < 12; p++)
+    for (int sq = 0; sq < 64; sq++)
+      zob_pieces[p][sq] = xorshift64star();
+
+  for (int r = 0; r < 16; r++)
+    zob_rights[r] = xorshift64star();
+
+  zob_ep[0] = 0;
+
+  for (int sq = 1; sq < 64; sq++)
+    zob_ep[sq] = xorshift64star();
+
+  zob_stm = xorshift64star();
+
+}
+
+/*}}}*/
+
+/*{{{  hash_position*/
+
+// from scratch - only used to set up a position and to check make_move in debug builds
+
+static uint64_t hash_position(const Position *pos) {
+
+  uint64_t hash = 0;
+
+  for (int sq = 0; sq < 64; sq++) {
+    if (piece_on(pos, sq) != EMPTY)
+      hash ^= zob_pieces[piece_on(pos, sq)][sq];
+  }
+
+  hash ^= zob_rights[pos->rights];
+  hash ^= zob_ep[pos->ep];
+
+  if (pos->stm == BLACK)
+    hash ^= zob_stm;
+
+  return hash;
+
+}
 
+/*}}}*/
 /*{{{  position*/
 
 static void position(Position *pos, const char *board_fen, const char *stm_str, const char *rights_str, const char *ep_str) {
@@ -794,7 +1517,7 @@ static void position(Position *pos, const char *board_fen, const char *stm_str,
   /*{{{  board*/
   
   for (int i=0; i < 64; i++)
-    pos->board[i] = EMPTY;
+    set_piece_on(pos, i, EMPTY);
   
   int sq = 56;
   
@@ -816,17 +1539,16 @@ static void position(Position *pos, const char *board_fen, const char *stm_str,
   
       uint64_t bb = 1ULL << sq;
   
-      pos->all[index]     |= bb;
-      pos->occupied       |= bb;
-      pos->colour[colour] |= bb;
-  
-      pos->board[sq] = index;
+      toggle_piece(pos, piece, colour, bb);
+      set_piece_on(pos, sq, index);
   
       sq++;
   
     }
   }
   
+  pos->occupied = pos->colour[WHITE] | pos->colour[BLACK];
+  
   /*}}}*/
   /*{{{  stm*/
   
@@ -868,228 +1590,342 @@ static void position(Position *pos, const char *board_fen, const char *stm_str,
   pos->hmc = 0;
   
   /*}}}*/
+  /*{{{  hash*/
+  
+  pos->hash = hash_position(pos);
+  
+  /*}}}*/
 
 }
 
 /*}}}*/
-/*{{{  is_attacked*/
+/*{{{  position_fen*/
 
-static inline int is_attacked(const Position * __restrict pos, int sq, const int opp) {
+// "board stm rights ep [hmc fmc]" - returns 0 if a field is missing
 
-  if (pos->all[piece_index(PAWN, opp)] & pawn_attacks[opp][sq])
-    return 1;
+static int position_fen(Position *pos, const char *fen) {
 
-  if (pos->all[piece_index(KNIGHT, opp)] & knight_attacks[sq])
-    return 1;
+  char buf[256];
+  char *fields[4];
+  char *save = NULL;
 
-  if (pos->all[piece_index(KING, opp)] & king_attacks[sq])
-    return 1;
+  strncpy(buf, fen, sizeof(buf) - 1);
+  buf[sizeof(buf) - 1] = '\0';
 
-  {
-    const Attack *a = &bishop_attacks[sq];
-    const uint64_t blockers = pos->occupied & a->mask;
-    const int idx = magic_index(blockers, a->magic, a->shift);
-    const uint64_t attacks = a->attacks[idx];
-    if (attacks & (pos->all[piece_index(BISHOP, opp)] | pos->all[piece_index(QUEEN, opp)]))
-      return 1;
+  for (int i=0; i < 4; i++) {
+    fields[i] = strtok_r(i ? NULL : buf, " \t\r\n", &save);
+    if (!fields[i])
+      return 0;
   }
 
-  {
-    const Attack *a = &rook_attacks[sq];
-    const uint64_t blockers = pos->occupied & a->mask;
-    const int idx = magic_index(blockers, a->magic, a->shift);
-    const uint64_t attacks = a->attacks[idx];
-    if (attacks & (pos->all[piece_index(ROOK, opp)] | pos->all[piece_index(QUEEN, opp)]))
-      return 1;
-  }
+  position(pos, fields[0], fields[1], fields[2], fields[3]);
 
-  return 0;
+  return 1;
 
 }
 
 /*}}}*/
+/*{{{  bench_position*/
 
-/*{{{  gen_sliders*/
+// a bench_tests fen without uci_exec, which would replace uci_game and with it
+// the game history of the next go - the fens are "p f ..." command lines
 
-static inline void gen_sliders(Node *node, Attack *attack_table, const int piece) {
+static void bench_position(Position *pos, const Perft *test) {
 
-  const Position *pos = &node->pos;
-  const int stm = pos->stm;
-  const uint64_t friends = pos->colour[stm];
-  //const uint64_t enemies = pos->colour[toggle(stm)];
-  const uint64_t opp_king = pos->all[piece_index(KING, toggle(stm))];
+  position_fen(pos, test->fen + 4);
 
-  uint64_t bb = pos->all[piece_index(piece, stm)];
+}
 
-  while (bb) {
+/*}}}*/
+/*{{{  is_attacked*/
 
-    const int from = bsf(bb);
-    bb &= bb - 1;
+static inline int is_attacked(const Position * __restrict pos, int sq, const int opp) {
 
-    const Attack *a = &attack_table[from];
-    const uint64_t blockers = pos->occupied & a->mask;
-    const int index = magic_index(blockers, a->magic, a->shift);
+  STAT_INC(is_attacked);
 
-    uint64_t attacks = a->attacks[index] & ~friends & ~opp_king;
+  if (piece_bb(pos, PAWN, opp) & pawn_attacks[opp][sq])
+    return 1;
 
-    while (attacks) {
+  if (piece_bb(pos, KNIGHT, opp) & knight_attacks[sq])
+    return 1;
 
-      const int to = bsf(attacks);
-      attacks &= attacks - 1;
+  if (piece_bb(pos, KING, opp) & king_attacks[sq])
+    return 1;
 
-      node->moves[node->num_moves++] = encode_move(from, to, 0);
+  if (slider_attacks(&bishop_attacks[sq], occupancy(pos)) & (piece_bb(pos, BISHOP, opp) | piece_bb(pos, QUEEN, opp)))
+    return 1;
+
+  if (slider_attacks(&rook_attacks[sq], occupancy(pos)) & (piece_bb(pos, ROOK, opp) | piece_bb(pos, QUEEN, opp)))
+    return 1;
+
+  return 0;
 
-    }
-  }
 }
 
 /*}}}*/
-/*{{{  gen_jumpers*/
-
-// hack scope to parallelise k and n
-// and/or not move k next to k - can optimise is_attacked as well then and gen_castling
 
-static inline void gen_jumpers(Node *node, const uint64_t *attack_table, const int piece) {
+/*{{{  pawn_attack_span*/
 
-  const Position *pos = &node->pos;
-  const int stm = pos->stm;
-  const uint64_t friends = pos->colour[stm];
-  //const uint64_t enemies = pos->colour[toggle(stm)];
-  const uint64_t opp_king = pos->all[piece_index(KING, toggle(stm))];
+// all squares attacked by the pawns in bb
 
-  uint64_t bb = pos->all[piece_index(piece, stm)];
+static inline __attribute__((always_inline)) uint64_t pawn_attack_span(const uint64_t bb, const int colour) {
 
-  while (bb) {
+  if (colour == WHITE)
+    return ((bb << 7) & NOT_H_FILE) | ((bb << 9) & NOT_A_FILE);
+  else
+    return ((bb >> 7) & NOT_A_FILE) | ((bb >> 9) & NOT_H_FILE);
 
-    const int from = bsf(bb);
-    bb &= bb - 1;
+}
 
-    uint64_t attacks = attack_table[from] & ~friends & ~opp_king;
+/*}}}*/
+/*{{{  between_bb*/
 
-    while (attacks) {
+// squares strictly between a and b if they share a line, else 0
 
-      const int to = bsf(attacks);
-      attacks &= attacks - 1;
+static inline __attribute__((always_inline)) uint64_t between_bb(const int a, const int b) {
 
-      node->moves[node->num_moves++] = encode_move(from, to, 0);
+  return between_table[a][b];
 
-    }
-  }
 }
 
 /*}}}*/
-/*{{{  gen_pawns*/
+/*{{{  line_bb*/
 
-static const uint64_t home_rank[2] = {RANK_2, RANK_7};
-static const int orth_offset[2]    = {8, -8};
-static const int left_offset[2]    = {7, -9};
-static const int right_offset[2]   = {9, -7};
+// the edge to edge line through a and b, both included, if they share one, else 0
 
-static void gen_pawns(Node *node) {
+static inline __attribute__((always_inline)) uint64_t line_bb(const int a, const int b) {
+
+  return line_table[a][b];
+
+}
+
+/*}}}*/
+/*{{{  attackers_to*/
+
+// every piece of either colour attacking sq given occupied, which need not be
+// the position's own - sliders see through anything left out of it
+
+static inline __attribute__((always_inline)) uint64_t attackers_to(const Position *pos, const int sq, const uint64_t occupied) {
+
+  const uint64_t queens = type_bb(pos, QUEEN);
+
+  return (pawn_attacks[WHITE][sq] & piece_bb(pos, PAWN, WHITE))
+       | (pawn_attacks[BLACK][sq] & piece_bb(pos, PAWN, BLACK))
+       | (knight_attacks[sq] & type_bb(pos, KNIGHT))
+       | (king_attacks[sq] & type_bb(pos, KING))
+       | (slider_attacks(&bishop_attacks[sq], occupied) & (type_bb(pos, BISHOP) | queens))
+       | (slider_attacks(&rook_attacks[sq], occupied) & (type_bb(pos, ROOK) | queens));
+
+}
+
+/*}}}*/
+/*{{{  threat_map*/
+
+// every square the side not to move attacks, one pass instead of an is_attacked
+// per square asked about - stm's king is lifted off the board so the squares
+// behind it on a checking line count as attacked, which is where it cannot go
+
+static inline __attribute__((always_inline)) uint64_t threat_map(const Position *pos, const int stm) {
 
-  const Position *pos = &node->pos;
-  const int stm = pos->stm;
   const int opp = toggle(stm);
 
-  const uint64_t pawns    = pos->all[piece_index(PAWN, stm)];
-  const uint64_t occupied = pos->occupied;
-  const uint64_t enemies  = pos->colour[opp];
-  const uint64_t opp_king = pos->all[piece_index(KING, opp)];
+  const uint64_t occupied   = occupancy(pos) & ~piece_bb(pos, KING, stm);
+  const uint64_t opp_queens = piece_bb(pos, QUEEN, opp);
+
+  uint64_t threats = pawn_attack_span(piece_bb(pos, PAWN, opp), opp) | king_attacks[bsf(piece_bb(pos, KING, opp))];
+
+  uint64_t bb = piece_bb(pos, KNIGHT, opp);
+  while (bb) {
+    threats |= knight_attacks[bsf(bb)];
+    bb &= bb - 1;
+  }
+
+  bb = piece_bb(pos, BISHOP, opp) | opp_queens;
+  while (bb) {
+    threats |= slider_attacks(&bishop_attacks[bsf(bb)], occupied);
+    bb &= bb - 1;
+  }
+
+  bb = piece_bb(pos, ROOK, opp) | opp_queens;
+  while (bb) {
+    threats |= slider_attacks(&rook_attacks[bsf(bb)], occupied);
+    bb &= bb - 1;
+  }
+
+  return threats;
+
+}
+
+/*}}}*/
+/*{{{  pin_candidates*/
+
+// the squares between stm's king and each enemy slider lined up with it on an
+// empty board - only a piece on one of them, moving off the line, can be pinned
+
+static inline __attribute__((always_inline)) uint64_t pin_candidates(const Position *pos, const int king_sq, const int stm) {
+
+  const int opp = toggle(stm);
+  const uint64_t opp_queens = piece_bb(pos, QUEEN, opp);
+
+  uint64_t snipers = (slider_attacks(&bishop_attacks[king_sq], 0) & (piece_bb(pos, BISHOP, opp) | opp_queens))
+                   | (slider_attacks(&rook_attacks[king_sq], 0) & (piece_bb(pos, ROOK, opp) | opp_queens));
+
+  uint64_t bb = 0;
+
+  while (snipers) {
+    bb |= between_bb(king_sq, bsf(snipers));
+    snipers &= snipers - 1;
+  }
+
+  return bb;
+
+}
+
+/*}}}*/
+/*{{{  gen_sliders*/
+
+// target is the squares the moves may go to - see gen_target
+
+static inline __attribute__((always_inline)) void gen_sliders(Node * __restrict node, const Position * __restrict pos, Attack *attack_table, const int piece, const int stm, const uint64_t target) {
+
+  STAT_INC(gen_sliders);
+
+  uint64_t bb = piece_bb(pos, piece, stm);
+
+  while (bb) {
+
+    const int from = bsf(bb);
+    bb &= bb - 1;
+
+    uint64_t attacks = slider_attacks(&attack_table[from], occupancy(pos)) & target;
+
+    while (attacks) {
+
+      const int to = bsf(attacks);
+      attacks &= attacks - 1;
+
+      node->moves[node->num_moves++] = encode_move(from, to, 0);
 
-  /*{{{  push 1*/
-  {
-    const int offset = orth_offset[stm];
-    const uint64_t bb = shift(pawns, offset) & ~occupied;
-  
-    uint64_t quiet_bb = bb & ~RANK_PROMO;
-    uint64_t promo_bb = bb & RANK_PROMO;
-  
-    while (quiet_bb) {
-      const int to = bsf(quiet_bb);
-      quiet_bb &= quiet_bb - 1;
-      node->moves[node->num_moves++] = encode_move(to - offset, to, 0);
     }
-  
-    while (promo_bb) {
-      const int to = bsf(promo_bb);
-      promo_bb &= promo_bb - 1;
+  }
+}
+
+/*}}}*/
+/*{{{  gen_jumpers*/
+
+// hack scope to parallelise k and n
+// and/or not move k next to k - can optimise is_attacked as well then and gen_castling
+
+static inline __attribute__((always_inline)) void gen_jumpers(Node * __restrict node, const Position * __restrict pos, const uint64_t *attack_table, const int piece, const int stm, const uint64_t target) {
+
+  STAT_INC(gen_jumpers);
+
+  uint64_t bb = piece_bb(pos, piece, stm);
+
+  while (bb) {
+
+    const int from = bsf(bb);
+    bb &= bb - 1;
+
+    uint64_t attacks = attack_table[from] & target;
+
+    while (attacks) {
+
+      const int to = bsf(attacks);
+      attacks &= attacks - 1;
+
+      node->moves[node->num_moves++] = encode_move(from, to, 0);
+
+    }
+  }
+}
+
+/*}}}*/
+/*{{{  add_pawn_moves*/
+
+// one move (to - offset) -> to for each bit of bb, with the promotions gen asks
+// for on the back ranks - all four, the queen alone for noisy, the other three for quiet
+
+static inline __attribute__((always_inline)) void add_pawn_moves(Node *node, const uint64_t bb, const int offset, const uint32_t flags, const int count_only, const int gen) {
+
+  uint64_t quiet_bb = bb & ~RANK_PROMO;
+  uint64_t promo_bb = bb & RANK_PROMO;
+
+  if (count_only) {
+    node->num_moves += popcount(quiet_bb) + (gen == GEN_ALL ? 4 : gen == GEN_NOISY ? 1 : 3) * popcount(promo_bb);
+    return;
+  }
+
+  while (quiet_bb) {
+    const int to = bsf(quiet_bb);
+    quiet_bb &= quiet_bb - 1;
+    node->moves[node->num_moves++] = encode_move(to - offset, to, flags);
+  }
+
+  while (promo_bb) {
+    const int to = bsf(promo_bb);
+    promo_bb &= promo_bb - 1;
+    if (gen != GEN_QUIET)
       node->moves[node->num_moves++] = encode_move(to - offset, to, MASK_Q_PROMO);
+    if (gen != GEN_NOISY) {
       node->moves[node->num_moves++] = encode_move(to - offset, to, MASK_R_PROMO);
       node->moves[node->num_moves++] = encode_move(to - offset, to, MASK_B_PROMO);
       node->moves[node->num_moves++] = encode_move(to - offset, to, MASK_N_PROMO);
     }
   }
-  
-  /*}}}*/
-  /*{{{  push 2*/
-  {
-    int offset = orth_offset[stm];
-    uint64_t bb = pawns & home_rank[stm];
-    bb = shift(bb, offset) & ~occupied;
-    bb = shift(bb, offset) & ~occupied;
-  
-    offset += offset;
-  
-    while (bb) {
-      const int to = bsf(bb);
-      bb &= bb - 1;
-      node->moves[node->num_moves++] = encode_move(to - offset, to, FLAG_PAWN_PUSH);
-    }
-  }
-  
-  /*}}}*/
-  /*{{{  left*/
+
+}
+
+/*}}}*/
+/*{{{  gen_pawns*/
+
+static const uint64_t home_rank[2] = {RANK_2, RANK_7};
+static const int orth_offset[2]    = {8, -8};
+static const int left_offset[2]    = {7, -9};
+static const int right_offset[2]   = {9, -7};
+
+// stm and gen are compile time constants at every call so the offsets and masks fold
+// target limits where the pawns may go, as for the pieces, and gen picks the
+// moves and promotions as in gen_legal - pushes only promote for noisy, captures
+// only underpromote for quiet
+
+static inline __attribute__((always_inline)) void gen_pawns(Node * __restrict node, const Position * __restrict pos, const int stm, const uint64_t target, const int gen) {
+
+  STAT_INC(gen_pawns);
+
+  const int opp = toggle(stm);
+
+  const uint64_t pawns    = piece_bb(pos, PAWN, stm);
+  const uint64_t occupied = occupancy(pos);
+  const uint64_t enemies  = pos->colour[opp];
+  const uint64_t opp_king = piece_bb(pos, KING, opp);
+
+  /*{{{  pushes*/
   {
-    const int offset = left_offset[stm];
-    const uint64_t bb = shift(pawns, offset) & enemies & NOT_H_FILE & ~opp_king;
+    const int offset = orth_offset[stm];
+    const uint64_t push_mask = target & (gen == GEN_NOISY ? RANK_PROMO : ~0ULL);
   
-    uint64_t quiet_bb = bb & ~RANK_PROMO;
-    uint64_t promo_bb = bb & RANK_PROMO;
+    const uint64_t push1 = shift(pawns, offset) & ~occupied;
+    const uint64_t push2 = shift(push1 & shift(home_rank[stm], offset), offset) & ~occupied;
   
-    while (quiet_bb) {
-      const int to = bsf(quiet_bb);
-      quiet_bb &= quiet_bb - 1;
-      node->moves[node->num_moves++] = encode_move(to - offset, to, 0);
-    }
+    add_pawn_moves(node, push1 & push_mask, offset, 0, 0, gen);
   
-    while (promo_bb) {
-      const int to = bsf(promo_bb);
-      promo_bb &= promo_bb - 1;
-      node->moves[node->num_moves++] = encode_move(to - offset, to, MASK_Q_PROMO);
-      node->moves[node->num_moves++] = encode_move(to - offset, to, MASK_R_PROMO);
-      node->moves[node->num_moves++] = encode_move(to - offset, to, MASK_B_PROMO);
-      node->moves[node->num_moves++] = encode_move(to - offset, to, MASK_N_PROMO);
-    }
+    if (gen != GEN_NOISY)
+      add_pawn_moves(node, push2 & push_mask, offset + offset, FLAG_PAWN_PUSH, 0, gen);
   }
   
   /*}}}*/
-  /*{{{  right*/
+  /*{{{  captures*/
   {
-    const int offset = right_offset[stm];
-    const uint64_t bb = shift(pawns, offset) & enemies & NOT_A_FILE & ~opp_king;
+    const uint64_t capture_mask = enemies & ~opp_king & target & (gen == GEN_QUIET ? RANK_PROMO : ~0ULL);
   
-    uint64_t quiet_bb = bb & ~RANK_PROMO;
-    uint64_t promo_bb = bb & RANK_PROMO;
-  
-    while (quiet_bb) {
-      const int to = bsf(quiet_bb);
-      quiet_bb &= quiet_bb - 1;
-      node->moves[node->num_moves++] = encode_move(to - offset, to, 0);
-    }
-  
-    while (promo_bb) {
-      const int to = bsf(promo_bb);
-      promo_bb &= promo_bb - 1;
-      node->moves[node->num_moves++] = encode_move(to - offset, to, MASK_Q_PROMO);
-      node->moves[node->num_moves++] = encode_move(to - offset, to, MASK_R_PROMO);
-      node->moves[node->num_moves++] = encode_move(to - offset, to, MASK_B_PROMO);
-      node->moves[node->num_moves++] = encode_move(to - offset, to, MASK_N_PROMO);
-    }
+    add_pawn_moves(node, shift(pawns, left_offset[stm])  & capture_mask & NOT_H_FILE, left_offset[stm],  0, 0, gen);
+    add_pawn_moves(node, shift(pawns, right_offset[stm]) & capture_mask & NOT_A_FILE, right_offset[stm], 0, 0, gen);
   }
   
   /*}}}*/
 
-  if (pos->ep) {
+  if (gen != GEN_QUIET && pos->ep) {
     /*{{{  ep*/
     
     uint64_t bb = pawn_attacks[stm][pos->ep] & pawns;
@@ -1108,263 +1944,3428 @@ static void gen_pawns(Node *node) {
 /*}}}*/
 /*{{{  gen_castling*/
 
-// hack optimise/generalise
+// threats is threat_map(pos, stm) - the king's square and the two it crosses must not be attacked
 
-static void gen_castling(Node *node) {
+static inline __attribute__((always_inline)) void gen_castling(Node * __restrict node, const Position * __restrict pos, const int stm, const uint64_t threats) {
 
-  const Position *pos = &node->pos;
-  const int stm = pos->stm;
-  const int opp = toggle(stm);
+  STAT_INC(gen_castling);
 
-  const uint64_t occupied = pos->occupied;
+  const uint64_t occupied = occupancy(pos);
 
   if (stm == WHITE) {
-    if ((pos->rights & WHITE_RIGHTS_KING) &&
-        !(occupied & 0x0000000000000060ULL) &&
-        !is_attacked(pos, E1, opp) &&
-        !is_attacked(pos, F1, opp) &&
-        !is_attacked(pos, G1, opp)) {
+    if ((pos->rights & WHITE_RIGHTS_KING) && !(occupied & 0x0000000000000060ULL) && !(threats & 0x0000000000000070ULL))
       node->moves[node->num_moves++] = encode_move(E1, G1, FLAG_CASTLE);
-    }
-    if ((pos->rights & WHITE_RIGHTS_QUEEN) &&
-        !(occupied & 0x000000000000000EULL) &&
-        !is_attacked(pos, E1, opp) &&
-        !is_attacked(pos, D1, opp) &&
-        !is_attacked(pos, C1, opp)) {
+    if ((pos->rights & WHITE_RIGHTS_QUEEN) && !(occupied & 0x000000000000000EULL) && !(threats & 0x000000000000001CULL))
       node->moves[node->num_moves++] = encode_move(E1, C1, FLAG_CASTLE);
-    }
   }
   else {
-    if ((pos->rights & BLACK_RIGHTS_KING) &&
-        !(occupied & 0x6000000000000000ULL) &&
-        !is_attacked(pos, E8, opp) &&
-        !is_attacked(pos, F8, opp) &&
-        !is_attacked(pos, G8, opp)) {
+    if ((pos->rights & BLACK_RIGHTS_KING) && !(occupied & 0x6000000000000000ULL) && !(threats & 0x7000000000000000ULL))
       node->moves[node->num_moves++] = encode_move(E8, G8, FLAG_CASTLE);
-    }
-    if ((pos->rights & BLACK_RIGHTS_QUEEN) &&
-        !(occupied & 0x0E00000000000000ULL) &&
-        !is_attacked(pos, E8, opp) &&
-        !is_attacked(pos, D8, opp) &&
-        !is_attacked(pos, C8, opp)) {
+    if ((pos->rights & BLACK_RIGHTS_QUEEN) && !(occupied & 0x0E00000000000000ULL) && !(threats & 0x1C00000000000000ULL))
       node->moves[node->num_moves++] = encode_move(E8, C8, FLAG_CASTLE);
-    }
   }
 }
 
+/*}}}*/
+/*{{{  gen_target*/
+
+// where the pieces may move for gen - never onto a friend or the enemy king
+
+static inline __attribute__((always_inline)) uint64_t gen_target(const Position *pos, const int stm, const int gen) {
+
+  const uint64_t opp_king = piece_bb(pos, KING, toggle(stm));
+
+  if (gen == GEN_NOISY)
+    return pos->colour[toggle(stm)] & ~opp_king;
+
+  if (gen == GEN_QUIET)
+    return ~occupancy(pos);
+
+  return ~pos->colour[stm] & ~opp_king;
+
+}
+
+/*}}}*/
+/*{{{  gen_evasions*/
+
+// pseudo legal moves out of check, instead of all moves with most rejected after
+// make_move - the king steps off the threatened squares, then unless it is double
+// check the other pieces capture the checker or block between it and the king
+
+static inline __attribute__((always_inline)) void gen_evasions(Node * __restrict node, const Position * __restrict pos, const uint64_t threats, const uint64_t checkers, const int stm) {
+
+  const int king_sq = bsf(piece_bb(pos, KING, stm));
+  const uint64_t target = gen_target(pos, stm, GEN_ALL);
+
+  gen_jumpers(node, pos, king_attacks, KING, stm, target & ~threats);
+
+  if (checkers & (checkers - 1))
+    return;
+
+  const uint64_t block = target & (checkers | between_bb(king_sq, bsf(checkers)));
+
+  gen_pawns(node, pos, stm, block, GEN_ALL);
+  gen_jumpers(node, pos, knight_attacks, KNIGHT, stm, block);
+  gen_sliders(node, pos, bishop_attacks, BISHOP, stm, block);
+  gen_sliders(node, pos, rook_attacks,   ROOK,   stm, block);
+  gen_sliders(node, pos, rook_attacks,   QUEEN,  stm, block);
+  gen_sliders(node, pos, bishop_attacks, QUEEN,  stm, block);
+
+}
+
 /*}}}*/
 /*{{{  gen_moves*/
 
-static void gen_moves(Node *node) {
+// pseudo legal - the caller rejects moves that leave the king in check
+// all and quiet leave the threat map in node->threats - the king moves and
+// castling never go onto it, and all generates only the evasions when in check
+
+static inline __attribute__((always_inline)) void gen_moves_stm(Node * __restrict node, const Position * __restrict pos, const int stm, const int gen) {
+
+  const uint64_t target = gen_target(pos, stm, gen);
 
   node->num_moves = 0;
 
-  gen_pawns(node);
-  gen_jumpers(node, knight_attacks, KNIGHT);
-  gen_sliders(node, bishop_attacks, BISHOP);
-  gen_sliders(node, rook_attacks,   ROOK);
-  gen_sliders(node, rook_attacks,   QUEEN);
-  gen_sliders(node, bishop_attacks, QUEEN);
-  gen_jumpers(node, king_attacks,   KING);
-  gen_castling(node);
+  uint64_t threats = 0;
+
+  if (gen != GEN_NOISY) {
+
+    threats = threat_map(pos, stm);
+    node->threats = threats;
+
+    const uint64_t king_bb = piece_bb(pos, KING, stm);
+
+    if (gen == GEN_ALL && (threats & king_bb)) {
+      gen_evasions(node, pos, threats, attackers_to(pos, bsf(king_bb), occupancy(pos)) & pos->colour[toggle(stm)], stm);
+      return;
+    }
+  }
+
+  gen_pawns(node, pos, stm, ~0ULL, gen);
+  gen_jumpers(node, pos, knight_attacks, KNIGHT, stm, target);
+  gen_sliders(node, pos, bishop_attacks, BISHOP, stm, target);
+  gen_sliders(node, pos, rook_attacks,   ROOK,   stm, target);
+  gen_sliders(node, pos, rook_attacks,   QUEEN,  stm, target);
+  gen_sliders(node, pos, bishop_attacks, QUEEN,  stm, target);
+  gen_jumpers(node, pos, king_attacks,   KING,   stm, target & ~threats);
+
+  if (gen != GEN_NOISY)
+    gen_castling(node, pos, stm, threats);
+
+}
+
+static void gen_moves_white(Node * __restrict node, const Position * __restrict pos) {
+
+  gen_moves_stm(node, pos, WHITE, GEN_ALL);
+  STAT_MOVES(node->num_moves);
+
+}
+
+static void gen_moves_black(Node * __restrict node, const Position * __restrict pos) {
+
+  gen_moves_stm(node, pos, BLACK, GEN_ALL);
+  STAT_MOVES(node->num_moves);
+
+}
+
+static void gen_moves(Node *node) {
+
+  if (node->pos.stm == WHITE)
+    gen_moves_white(node, &node->pos);
+  else
+    gen_moves_black(node, &node->pos);
 
 }
 
 /*}}}*/
+/*{{{  gen_captures*/
 
-/*{{{  make_move*/
+// pseudo legal captures, ep and queen promotions - qsearch, without
+// generating the quiets only to throw them away
 
-/*{{{  helper tables*/
+static void gen_captures(Node *node) {
 
-#pragma GCC diagnostic push
-#pragma GCC diagnostic ignored "-Winitializer-overrides"
+  if (node->pos.stm == WHITE)
+    gen_moves_stm(node, &node->pos, WHITE, GEN_NOISY);
+  else
+    gen_moves_stm(node, &node->pos, BLACK, GEN_NOISY);
 
-static const uint8_t rook_to[64] = {
-  [G1] = F1,
-  [C1] = D1,
-  [G8] = F8,
-  [C8] = D8,
-};
+}
 
-static const uint8_t rook_from[64] = {
-  [G1] = H1,
-  [C1] = A1,
-  [G8] = H8,
-  [C8] = A8,
-};
+/*}}}*/
+/*{{{  gen_quiets*/
 
-static const uint8_t rights_mask[64] = {
-  [0 ... 63] = ALL_RIGHTS,
-  [A1] = ALL_RIGHTS & ~WHITE_RIGHTS_QUEEN,
-  [H1] = ALL_RIGHTS & ~WHITE_RIGHTS_KING,
-  [E1] = ALL_RIGHTS & ~(WHITE_RIGHTS_KING | WHITE_RIGHTS_QUEEN),
+// pseudo legal, everything gen_captures leaves out
 
-  [A8] = ALL_RIGHTS & ~BLACK_RIGHTS_QUEEN,
-  [H8] = ALL_RIGHTS & ~BLACK_RIGHTS_KING,
-  [E8] = ALL_RIGHTS & ~(BLACK_RIGHTS_KING | BLACK_RIGHTS_QUEEN)
-};
+static void gen_quiets(Node *node) {
+
+  if (node->pos.stm == WHITE)
+    gen_moves_stm(node, &node->pos, WHITE, GEN_QUIET);
+  else
+    gen_moves_stm(node, &node->pos, BLACK, GEN_QUIET);
+
+}
+
+/*}}}*/
+
+/*{{{  gen_legal*/
+
+/*{{{  add_move*/
+
+// when counting only the number of moves is kept, nothing is written to the list
+
+static inline __attribute__((always_inline)) void add_move(Node *node, const uint32_t move, const int count_only) {
+
+  if (!count_only)
+    node->moves[node->num_moves] = move;
+
+  node->num_moves++;
+
+}
+
+/*}}}*/
+/*{{{  add_moves*/
+
+// one move from -> each bit of bb
+
+static inline __attribute__((always_inline)) void add_moves(Node *node, const int from, uint64_t bb, const int count_only) {
+
+  if (count_only) {
+    node->num_moves += popcount(bb);
+    return;
+  }
+
+  while (bb) {
+    const int to = bsf(bb);
+    bb &= bb - 1;
+    node->moves[node->num_moves++] = encode_move(from, to, 0);
+  }
+
+}
+
+/*}}}*/
+/*{{{  add_legal_pawn_moves*/
+
+// pawns set-wise, pushes restricted to push_mask and captures to capture_mask
+
+static inline __attribute__((always_inline)) void add_legal_pawn_moves(Node * __restrict node, const Position * __restrict pos, const uint64_t pawns, const uint64_t push_mask,
+                                                                      const uint64_t capture_mask, const int stm, const int count_only, const int gen) {
+
+  const uint64_t occupied = occupancy(pos);
+
+  const int offset = orth_offset[stm];
+  const uint64_t push1 = shift(pawns, offset) & ~occupied;
+  const uint64_t push2 = shift(push1 & shift(home_rank[stm], offset), offset) & ~occupied;
+
+  add_pawn_moves(node, push1 & push_mask, offset, 0, count_only, gen);
+  add_pawn_moves(node, push2 & push_mask, offset + offset, FLAG_PAWN_PUSH, count_only, gen);
+
+  add_pawn_moves(node, shift(pawns, left_offset[stm])  & capture_mask & NOT_H_FILE, left_offset[stm],  0, count_only, gen);
+  add_pawn_moves(node, shift(pawns, right_offset[stm]) & capture_mask & NOT_A_FILE, right_offset[stm], 0, count_only, gen);
+
+}
+
+/*}}}*/
+/*{{{  add_legal_piece_moves*/
+
+// pieces in bb, pinned ones limited to their pin ray; slider_table is NULL for jumpers
+
+static inline __attribute__((always_inline)) void add_legal_piece_moves(Node * __restrict node, const Position * __restrict pos, uint64_t bb, const Attack *slider_table, const uint64_t *jumper_table,
+                                                                       const uint64_t target, const uint64_t pinned, const uint64_t *pin_ray,
+                                                                       const int count_only) {
+
+  const uint64_t occupied = occupancy(pos);
+
+  while (bb) {
+
+    const int from = bsf(bb);
+    bb &= bb - 1;
+
+    uint64_t attacks = slider_table ? slider_attacks(&slider_table[from], occupied) : jumper_table[from];
+
+    attacks &= target;
+
+    if (pinned & (1ULL << from))
+      attacks &= pin_ray[from];
+
+    add_moves(node, from, attacks, count_only);
+
+  }
+}
+
+/*}}}*/
+
+// computes the checkers, pinned pieces and the squares the king cannot go to once,
+// then only emits legal moves - no make_move + is_attacked filter needed
+// with count_only set the moves are counted but not written (bulk counting in perft)
+// gen is a compile time constant at every call so the unused masks fold away
+
+static inline __attribute__((always_inline)) void gen_legal(Node * __restrict node, const Position * __restrict pos, const int stm, const int count_only, const int gen) {
+
+  STAT_INC(gen_legal);
+
+  const int opp = toggle(stm);
+
+  node->num_moves = 0;
+
+  const uint64_t friends  = pos->colour[stm];
+  const uint64_t enemies  = pos->colour[opp];
+  const uint64_t occupied = occupancy(pos);
+
+  const uint64_t king_bb = piece_bb(pos, KING, stm);
+  const int king_sq = bsf(king_bb);
+
+  const uint64_t opp_pawns   = piece_bb(pos, PAWN, opp);
+  const uint64_t opp_knights = piece_bb(pos, KNIGHT, opp);
+  const uint64_t opp_diag    = piece_bb(pos, BISHOP, opp) | piece_bb(pos, QUEEN, opp);
+  const uint64_t opp_orth    = piece_bb(pos, ROOK, opp) | piece_bb(pos, QUEEN, opp);
+
+  const uint64_t danger = threat_map(pos, stm);
+
+  node->threats = danger;
+
+  /*{{{  king moves*/
+  
+  const uint64_t gen_mask = gen == GEN_NOISY ? enemies : gen == GEN_QUIET ? ~enemies : ~0ULL;
+  
+  {
+    add_moves(node, king_sq, king_attacks[king_sq] & ~friends & ~danger & gen_mask, count_only);
+  }
+  
+  /*}}}*/
+
+  const uint64_t checkers = (danger & king_bb) ? attackers_to(pos, king_sq, occupied) & enemies : 0;
+
+  if (checkers & (checkers - 1))
+    return;  // double check - only the king can move
+
+  /*{{{  check mask*/
+  
+  uint64_t check_mask = ~0ULL;
+  
+  if (checkers)
+    check_mask = checkers | between_bb(king_sq, bsf(checkers));
+  
+  const uint64_t target = ~friends & check_mask & gen_mask;
+  
+  /*}}}*/
+  /*{{{  pins*/
+  
+  // x-ray from the king through friendly pieces to find snipers
+  
+  uint64_t pinned = 0;
+  uint64_t pin_ray[64];
+  
+  {
+    uint64_t snipers = (slider_attacks(&bishop_attacks[king_sq], enemies) & opp_diag)
+                     | (slider_attacks(&rook_attacks[king_sq], enemies) & opp_orth);
+  
+    while (snipers) {
+  
+      const int sniper = bsf(snipers);
+      snipers &= snipers - 1;
+  
+      const uint64_t ray = between_bb(king_sq, sniper);
+      const uint64_t blockers = ray & occupied;
+  
+      if (blockers && !(blockers & (blockers - 1))) {
+        pinned |= blockers;
+        pin_ray[bsf(blockers)] = ray | (1ULL << sniper);
+      }
+    }
+  }
+  
+  /*}}}*/
+  /*{{{  pawns*/
+  
+  {
+    const uint64_t pawns = piece_bb(pos, PAWN, stm);
+  
+    const uint64_t push_mask    = check_mask & (gen == GEN_NOISY ? RANK_PROMO : ~0ULL);
+    const uint64_t capture_mask = check_mask & enemies & (gen == GEN_QUIET ? RANK_PROMO : ~0ULL);
+  
+    add_legal_pawn_moves(node, pos, pawns & ~pinned, push_mask, capture_mask, stm, count_only, gen);
+  
+    uint64_t bb = pawns & pinned;
+  
+    while (bb) {
+      const int from = bsf(bb);
+      bb &= bb - 1;
+      add_legal_pawn_moves(node, pos, 1ULL << from, push_mask & pin_ray[from], capture_mask & pin_ray[from], stm, count_only, gen);
+    }
+  
+    if (gen != GEN_QUIET && pos->ep) {
+      /*{{{  ep*/
+      
+      // test the resulting occupancy directly, covering evasions, pins
+      // and the discovered check along the rank when both pawns leave it
+      
+      const int ep = pos->ep;
+      const uint64_t cap_bb = 1ULL << (ep + orth_offset[opp]);
+      
+      uint64_t bb = pawn_attacks[stm][ep] & pawns;
+      
+      while (bb) {
+      
+        const int from = bsf(bb);
+        bb &= bb - 1;
+      
+        const uint64_t occ = (occupied ^ (1ULL << from) ^ cap_bb) | (1ULL << ep);
+      
+        if (checkers & ~cap_bb & (opp_pawns | opp_knights))
+          continue;
+      
+        if (slider_attacks(&bishop_attacks[king_sq], occ) & opp_diag)
+          continue;
+      
+        if (slider_attacks(&rook_attacks[king_sq], occ) & opp_orth)
+          continue;
+      
+        add_move(node, encode_move(from, ep, FLAG_EP_CAPTURE), count_only);
+      
+      }
+      
+      /*}}}*/
+    }
+  }
+  
+  /*}}}*/
+  /*{{{  pieces*/
+  
+  const uint64_t queens = piece_bb(pos, QUEEN, stm);
+  
+  add_legal_piece_moves(node, pos, piece_bb(pos, KNIGHT, stm) & ~pinned, NULL, knight_attacks, target, 0, pin_ray, count_only);
+  add_legal_piece_moves(node, pos, piece_bb(pos, BISHOP, stm) | queens, bishop_attacks, NULL, target, pinned, pin_ray, count_only);
+  add_legal_piece_moves(node, pos, piece_bb(pos, ROOK, stm) | queens, rook_attacks,   NULL, target, pinned, pin_ray, count_only);
+  
+  /*}}}*/
+  /*{{{  castling*/
+  
+  if (gen != GEN_NOISY && !checkers && (pos->rights & (stm == WHITE ? WHITE_RIGHTS_KING | WHITE_RIGHTS_QUEEN : BLACK_RIGHTS_KING | BLACK_RIGHTS_QUEEN))) {
+  
+    if (stm == WHITE) {
+      if ((pos->rights & WHITE_RIGHTS_KING) && !(occupied & 0x0000000000000060ULL) && !(danger & 0x0000000000000060ULL))
+        add_move(node, encode_move(E1, G1, FLAG_CASTLE), count_only);
+      if ((pos->rights & WHITE_RIGHTS_QUEEN) && !(occupied & 0x000000000000000EULL) && !(danger & 0x000000000000000CULL))
+        add_move(node, encode_move(E1, C1, FLAG_CASTLE), count_only);
+    }
+    else {
+      if ((pos->rights & BLACK_RIGHTS_KING) && !(occupied & 0x6000000000000000ULL) && !(danger & 0x6000000000000000ULL))
+        add_move(node, encode_move(E8, G8, FLAG_CASTLE), count_only);
+      if ((pos->rights & BLACK_RIGHTS_QUEEN) && !(occupied & 0x0E00000000000000ULL) && !(danger & 0x0C00000000000000ULL))
+        add_move(node, encode_move(E8, C8, FLAG_CASTLE), count_only);
+    }
+  }
+  
+  /*}}}*/
+
+}
+
+/*}}}*/
+
+/*{{{  gen_legal_moves*/
+
+static void gen_legal_moves_white(Node * __restrict node, const Position * __restrict pos) {
+
+  gen_legal(node, pos, WHITE, 0, GEN_ALL);
+  STAT_MOVES(node->num_moves);
+
+}
+
+static void gen_legal_moves_black(Node * __restrict node, const Position * __restrict pos) {
+
+  gen_legal(node, pos, BLACK, 0, GEN_ALL);
+  STAT_MOVES(node->num_moves);
+
+}
+
+static void gen_legal_moves(Node *node) {
+
+  if (node->pos.stm == WHITE)
+    gen_legal_moves_white(node, &node->pos);
+  else
+    gen_legal_moves_black(node, &node->pos);
+
+}
+
+/*}}}*/
+/*{{{  count_legal_moves*/
+
+static int count_legal_moves_white(Node * __restrict node, const Position * __restrict pos) {
+
+  gen_legal(node, pos, WHITE, 1, GEN_ALL);
+  STAT_MOVES(node->num_moves);
+
+  return node->num_moves;
+
+}
+
+static int count_legal_moves_black(Node * __restrict node, const Position * __restrict pos) {
+
+  gen_legal(node, pos, BLACK, 1, GEN_ALL);
+  STAT_MOVES(node->num_moves);
+
+  return node->num_moves;
+
+}
+
+/*}}}*/
+/*{{{  gen_noisy_moves*/
+
+// the staged move picker's captures, ep and promotions
+
+static void gen_noisy_moves(Node *node) {
+
+  if (node->pos.stm == WHITE)
+    gen_legal(node, &node->pos, WHITE, 0, GEN_NOISY);
+  else
+    gen_legal(node, &node->pos, BLACK, 0, GEN_NOISY);
+
+}
+
+/*}}}*/
+/*{{{  gen_quiet_moves*/
+
+// everything gen_noisy_moves leaves out
+
+static void gen_quiet_moves(Node *node) {
+
+  if (node->pos.stm == WHITE)
+    gen_legal(node, &node->pos, WHITE, 0, GEN_QUIET);
+  else
+    gen_legal(node, &node->pos, BLACK, 0, GEN_QUIET);
+
+}
+
+/*}}}*/
+
+/*{{{  make_move*/
+
+/*{{{  helper tables*/
+
+#pragma GCC diagnostic push
+#pragma GCC diagnostic ignored "-Winitializer-overrides"
+
+static const uint8_t rook_to[64] = {
+  [G1] = F1,
+  [C1] = D1,
+  [G8] = F8,
+  [C8] = D8,
+};
+
+static const uint8_t rook_from[64] = {
+  [G1] = H1,
+  [C1] = A1,
+  [G8] = H8,
+  [C8] = A8,
+};
+
+static const uint8_t rights_mask[64] = {
+  [0 ... 63] = ALL_RIGHTS,
+  [A1] = ALL_RIGHTS & ~WHITE_RIGHTS_QUEEN,
+  [H1] = ALL_RIGHTS & ~WHITE_RIGHTS_KING,
+  [E1] = ALL_RIGHTS & ~(WHITE_RIGHTS_KING | WHITE_RIGHTS_QUEEN),
+
+  [A8] = ALL_RIGHTS & ~BLACK_RIGHTS_QUEEN,
+  [H8] = ALL_RIGHTS & ~BLACK_RIGHTS_KING,
+  [E8] = ALL_RIGHTS & ~(BLACK_RIGHTS_KING | BLACK_RIGHTS_QUEEN)
+};
+
+/*}}}*/
+
+/*{{{  move_kind*/
+
+static inline __attribute__((always_inline)) int move_kind(const uint32_t move, const int captured) {
+
+  return ((move & MASK_SPECIAL) >> KIND_SHIFT) | (captured != EMPTY);
+
+}
+
+/*}}}*/
+/*{{{  move_piece*/
+
+// the board primitives used by the make_move paths, returning the hash delta
+
+static inline __attribute__((always_inline)) uint64_t move_piece(Position * __restrict pos, const int piece, const int from, const int to, const int colour) {
+
+  toggle_piece(pos, piece - piece_index(PAWN, colour), colour, (1ULL << from) | (1ULL << to));
+
+  set_piece_on(pos, from, EMPTY);
+  set_piece_on(pos, to, piece);
+
+  return zob_pieces[piece][from] ^ zob_pieces[piece][to];
+
+}
+
+/*}}}*/
+/*{{{  remove_piece*/
+
+static inline __attribute__((always_inline)) uint64_t remove_piece(Position * __restrict pos, const int piece, const int sq, const int colour) {
+
+  toggle_piece(pos, piece - piece_index(PAWN, colour), colour, 1ULL << sq);
+
+  set_piece_on(pos, sq, EMPTY);
+
+  return zob_pieces[piece][sq];
+
+}
+
+/*}}}*/
+/*{{{  put_piece*/
+
+static inline __attribute__((always_inline)) uint64_t put_piece(Position * __restrict pos, const int piece, const int sq, const int colour) {
+
+  toggle_piece(pos, piece - piece_index(PAWN, colour), colour, 1ULL << sq);
+
+  set_piece_on(pos, sq, piece);
+
+  return zob_pieces[piece][sq];
+
+}
+
+/*}}}*/
+
+// stm is a compile time constant at every call - see make_move_white/black
+// one straight line path per move kind, picked by a switch that compiles to a jump table
+
+static inline __attribute__((always_inline)) void make_move_stm(Position * __restrict pos, const uint64_t move, const int stm) {
+
+  const int from = (move >> 6) & 0x3F;
+  const int to   = move & 0x3F;
+
+  const int opp = toggle(stm);
+
+  const int from_piece = piece_on(pos, from);
+  const int to_piece   = piece_on(pos, to);
+
+  const int kind = move_kind(move, to_piece);
+
+#ifdef STATS
+  stats.make_move[(move & FLAG_PROMO)      ? MOVE_PROMO  :
+                  (move & FLAG_EP_CAPTURE) ? MOVE_EP     :
+                  (move & FLAG_PAWN_PUSH)  ? MOVE_PUSH   :
+                  (move & FLAG_CASTLE)     ? MOVE_CASTLE :
+                  (to_piece != EMPTY)      ? MOVE_CAPTURE : MOVE_QUIET]++;
+#endif
+
+  uint64_t hash = pos->hash ^ zob_stm ^ zob_ep[pos->ep] ^ zob_rights[pos->rights];
+
+  pos->ep = 0;
+  pos->rights &= rights_mask[from] & rights_mask[to];
+  pos->hmc = (to_piece != EMPTY || from_piece == piece_index(PAWN, stm)) ? 0 : pos->hmc + 1;
+
+  switch (kind) {
+
+    case KIND_QUIET:
+      hash ^= move_piece(pos, from_piece, from, to, stm);
+      break;
+
+    case KIND_CAPTURE:
+      hash ^= remove_piece(pos, to_piece, to, opp);
+      hash ^= move_piece(pos, from_piece, from, to, stm);
+      break;
+
+    case KIND_PUSH:
+      hash ^= move_piece(pos, from_piece, from, to, stm);
+      pos->ep = from + orth_offset[stm];
+      break;
+
+    case KIND_EP:
+      hash ^= move_piece(pos, from_piece, from, to, stm);
+      hash ^= remove_piece(pos, piece_index(PAWN, opp), to + orth_offset[opp], opp);
+      break;
+
+    case KIND_CASTLE:
+      hash ^= move_piece(pos, from_piece, from, to, stm);
+      hash ^= move_piece(pos, piece_index(ROOK, stm), rook_from[to], rook_to[to], stm);
+      break;
+
+    case KIND_PROMO_CAPTURE:
+      hash ^= remove_piece(pos, to_piece, to, opp);
+      /* fall through */
+
+    case KIND_PROMO:
+      hash ^= remove_piece(pos, from_piece, from, stm);
+      hash ^= put_piece(pos, piece_index(((move >> PROMO_SHIFT) & 3) + 1, stm), to, stm);
+      break;
+
+    default:
+      __builtin_unreachable();
+
+  }
+
+  pos->occupied = pos->colour[WHITE] | pos->colour[BLACK];
+  pos->stm = opp;
+
+  pos->hash = hash ^ zob_ep[pos->ep] ^ zob_rights[pos->rights];
+
+  assert(pos->hash == hash_position(pos) && "incremental hash mismatch");
+
+}
+
+static void make_move_white(Position * __restrict pos, const uint64_t move) {
+
+  make_move_stm(pos, move, WHITE);
+
+}
+
+static void make_move_black(Position * __restrict pos, const uint64_t move) {
+
+  make_move_stm(pos, move, BLACK);
+
+}
+
+static void make_move(Position * __restrict pos, const uint64_t move) {
+
+  if (pos->stm == WHITE)
+    make_move_white(pos, move);
+  else
+    make_move_black(pos, move);
+
+}
+
+/*}}}*/
+/*{{{  make_move_undo*/
+
+// in place make for make/unmake - the undo record is all unmake_move needs
+
+static inline __attribute__((always_inline)) void make_move_undo_stm(Position * __restrict pos, const uint64_t move, Undo *undo, const int stm) {
+
+  undo->hash     = pos->hash;
+  undo->captured = piece_on(pos, move & 0x3F);
+  undo->rights   = pos->rights;
+  undo->ep       = pos->ep;
+  undo->hmc      = pos->hmc;
+
+  make_move_stm(pos, move, stm);
+
+}
+
+static void make_move_undo_white(Position * __restrict pos, const uint64_t move, Undo *undo) {
+
+  make_move_undo_stm(pos, move, undo, WHITE);
+
+}
+
+static void make_move_undo_black(Position * __restrict pos, const uint64_t move, Undo *undo) {
+
+  make_move_undo_stm(pos, move, undo, BLACK);
+
+}
+
+/*}}}*/
+/*{{{  unmake_move*/
+
+// stm is the side that made the move, a compile time constant as in make_move_stm
+
+static inline __attribute__((always_inline)) void unmake_move_stm(Position * __restrict pos, const uint64_t move, const Undo *undo, const int stm) {
+
+  const int from = (move >> 6) & 0x3F;
+  const int to   = move & 0x3F;
+
+  const int opp = toggle(stm);
+
+  const int moved = piece_on(pos, to);
+
+  switch (move_kind(move, undo->captured)) {
+
+    case KIND_QUIET:
+    case KIND_PUSH:
+      move_piece(pos, moved, to, from, stm);
+      break;
+
+    case KIND_CAPTURE:
+      move_piece(pos, moved, to, from, stm);
+      put_piece(pos, undo->captured, to, opp);
+      break;
+
+    case KIND_EP:
+      move_piece(pos, moved, to, from, stm);
+      put_piece(pos, piece_index(PAWN, opp), to + orth_offset[opp], opp);
+      break;
+
+    case KIND_CASTLE:
+      move_piece(pos, moved, to, from, stm);
+      move_piece(pos, piece_index(ROOK, stm), rook_to[to], rook_from[to], stm);
+      break;
+
+    case KIND_PROMO_CAPTURE:
+      remove_piece(pos, moved, to, stm);
+      put_piece(pos, piece_index(PAWN, stm), from, stm);
+      put_piece(pos, undo->captured, to, opp);
+      break;
+
+    case KIND_PROMO:
+      remove_piece(pos, moved, to, stm);
+      put_piece(pos, piece_index(PAWN, stm), from, stm);
+      break;
+
+    default:
+      __builtin_unreachable();
+
+  }
+
+  pos->occupied = pos->colour[WHITE] | pos->colour[BLACK];
+  pos->stm = stm;
+
+  pos->hash   = undo->hash;
+  pos->rights = undo->rights;
+  pos->ep     = undo->ep;
+  pos->hmc    = undo->hmc;
+
+  assert(pos->hash == hash_position(pos) && "unmake_move hash mismatch");
+
+}
+
+static void unmake_move_white(Position * __restrict pos, const uint64_t move, const Undo *undo) {
+
+  unmake_move_stm(pos, move, undo, WHITE);
+
+}
+
+static void unmake_move_black(Position * __restrict pos, const uint64_t move, const Undo *undo) {
+
+  unmake_move_stm(pos, move, undo, BLACK);
+
+}
+
+/*}}}*/
+
+/*{{{  perft_hash_resize*/
+
+// a power of two number of 64 byte buckets, 0 mb disables the table
+
+static void perft_hash_resize(const int mb) {
+
+  if (mb == perft_table_mb)
+    return;
+
+  free(perft_table);
+
+  perft_table      = NULL;
+  perft_table_mask = 0;
+  perft_table_mb   = 0;
+
+  if (mb <= 0)
+    return;
+
+  uint64_t num_buckets = 1;
+
+  while (num_buckets * 2 * sizeof(PerftBucket) <= (uint64_t)mb * 1024 * 1024)
+    num_buckets *= 2;
+
+  perft_table = aligned_alloc(64, num_buckets * sizeof(PerftBucket));
+  if (!perft_table) {
+    fprintf(stderr, "aligned_alloc failed for perft hash (%d mb)\n", mb);
+    exit(1);
+  }
+
+  perft_table_mask = num_buckets - 1;
+  perft_table_mb   = mb;
+
+}
+
+/*}}}*/
+/*{{{  perft_hash_clear*/
+
+static void perft_hash_clear(void) {
+
+  if (perft_table)
+    memset(perft_table, 0, (perft_table_mask + 1) * sizeof(PerftBucket));
+
+}
+
+/*}}}*/
+/*{{{  perft_probe*/
+
+// 0 is a miss, so subtrees with no leaves are just recomputed
+
+static inline uint64_t perft_probe(const uint64_t hash, const int depth) {
+
+  const PerftBucket *bucket = &perft_table[hash & perft_table_mask];
+
+  for (int i=0; i < PERFT_BUCKET_ENTRIES; i++) {
+
+    const uint64_t key  = __atomic_load_n(&bucket->entries[i].key,  __ATOMIC_RELAXED);
+    const uint64_t data = __atomic_load_n(&bucket->entries[i].data, __ATOMIC_RELAXED);
+
+    if ((key ^ data) == hash && (int)(data & 0xFF) == depth)
+      return data >> 8;
+
+  }
+
+  return 0;
+
+}
+
+/*}}}*/
+/*{{{  perft_store*/
+
+// replace the same position and depth if present, else the shallowest entry
+
+static inline void perft_store(const uint64_t hash, const int depth, const uint64_t nodes) {
+
+  PerftBucket *bucket = &perft_table[hash & perft_table_mask];
+
+  const uint64_t data = (nodes << 8) | (uint64_t)depth;
+
+  int victim = 0;
+  int victim_depth = 256;
+
+  for (int i=0; i < PERFT_BUCKET_ENTRIES; i++) {
+
+    const uint64_t entry_key  = __atomic_load_n(&bucket->entries[i].key,  __ATOMIC_RELAXED);
+    const uint64_t entry_data = __atomic_load_n(&bucket->entries[i].data, __ATOMIC_RELAXED);
+    const int entry_depth = entry_data & 0xFF;
+
+    if ((entry_key ^ entry_data) == hash && entry_depth == depth)
+      return;
+
+    if (entry_depth < victim_depth) {
+      victim = i;
+      victim_depth = entry_depth;
+    }
+  }
+
+  __atomic_store_n(&bucket->entries[victim].key,  hash ^ data, __ATOMIC_RELAXED);
+  __atomic_store_n(&bucket->entries[victim].data, data,        __ATOMIC_RELAXED);
+
+}
+
+/*}}}*/
+/*{{{  perft*/
+
+static uint64_t perft_white(Node *node, Position *pos, const int depth);
+static uint64_t perft_black(Node *node, Position *pos, const int depth);
+
+// node is the top of a Node stack with at least depth+1 entries, used for the
+// move lists and undo records - pos is node->pos with copy-make and the one
+// shared position with perft_opts.unmake
+// stm is a compile time constant so the recursion alternates between
+// the white and black specialisations of the generators and make_move
+
+static inline __attribute__((always_inline)) uint64_t perft_stm(Node *node, Position *pos, const int depth, const int stm) {
+
+  if (depth == 0)
+    return 1;
+
+  if (depth == 1 && perft_opts.bulk && perft_opts.legal)
+    return stm == WHITE ? count_legal_moves_white(node, pos) : count_legal_moves_black(node, pos);
+
+  if (perft_table && depth >= 2) {
+    const uint64_t cached = perft_probe(pos->hash, depth);
+    if (cached)
+      return cached;
+  }
+
+  Node *next = node + 1;
+
+  const int legal  = perft_opts.legal;
+  const int unmake = perft_opts.unmake;
+
+  int king_sq = 0;
+  uint64_t pinnable = 0;
+
+  if (legal) {
+    if (stm == WHITE)
+      gen_legal_moves_white(node, pos);
+    else
+      gen_legal_moves_black(node, pos);
+  }
+  else {
+    if (stm == WHITE)
+      gen_moves_white(node, pos);
+    else
+      gen_moves_black(node, pos);
+    king_sq  = bsf(piece_bb(pos, KING, stm));
+    pinnable = pin_candidates(pos, king_sq, stm);
+  }
+
+  uint64_t total_searched = 0;
+
+  for (int i=0; i < node->num_moves; i++) {
+
+    const uint32_t move = node->moves[i];
+
+    Position *child = pos;
+
+    /*{{{  make*/
+    
+    if (unmake) {
+      if (stm == WHITE)
+        make_move_undo_white(pos, move, &node->undo);
+      else
+        make_move_undo_black(pos, move, &node->undo);
+    }
+    
+    else {
+    
+      child = &next->pos;
+      *child = *pos;
+    
+      if (stm == WHITE)
+        make_move_white(child, move);
+      else
+        make_move_black(child, move);
+    
+    }
+    
+    /*}}}*/
+
+    if (!legal) {
+      /*{{{  reject if king left in check*/
+      
+      // the king moves, castling and evasions were kept off node->threats, so
+      // only ep or a piece leaving a possible pin line can expose the king
+      
+      const int from = (move >> 6) & 0x3F;
+      
+      STAT_INC(perft_pseudo);
+      
+      if ((move & FLAG_EP_CAPTURE) || ((pinnable & (1ULL << from)) && !(line_bb(king_sq, from) & (1ULL << (move & 0x3F))))) {
+      
+        STAT_INC(perft_tested);
+      
+        if (is_attacked(child, bsf(piece_bb(child, KING, stm)), toggle(stm))) {
+      
+          STAT_INC(perft_rejected);
+      
+          if (unmake) {
+            if (stm == WHITE)
+              unmake_move_white(pos, move, &node->undo);
+            else
+              unmake_move_black(pos, move, &node->undo);
+          }
+      
+          continue;
+      
+        }
+      }
+      
+      /*}}}*/
+    }
+
+    total_searched += stm == WHITE ? perft_black(next, child, depth-1) : perft_white(next, child, depth-1);
+
+    if (unmake) {
+      if (stm == WHITE)
+        unmake_move_white(pos, move, &node->undo);
+      else
+        unmake_move_black(pos, move, &node->undo);
+    }
+
+  }
+
+  if (perft_table && depth >= 2)
+    perft_store(pos->hash, depth, total_searched);
+
+  return total_searched;
+
+}
+
+static uint64_t perft_white(Node *node, Position *pos, const int depth) {
+
+  return perft_stm(node, pos, depth, WHITE);
+
+}
+
+static uint64_t perft_black(Node *node, Position *pos, const int depth) {
+
+  return perft_stm(node, pos, depth, BLACK);
+
+}
+
+static uint64_t perft(Node *node, const int depth) {
+
+  if (node->pos.stm == WHITE)
+    return perft_white(node, &node->pos, depth);
+  else
+    return perft_black(node, &node->pos, depth);
+
+}
+
+/*}}}*/
+/*{{{  alloc_stack*/
+
+// per-thread Node stacks so workers never touch ss[]
+
+static Node *alloc_stack(void) {
+
+  Node *stack = aligned_alloc(64, MAX_PLY * sizeof(Node));
+  if (!stack) {
+    fprintf(stderr, "aligned_alloc failed for node stack\n");
+    exit(1);
+  }
+
+  memset(stack, 0, MAX_PLY * sizeof(Node));
+
+  return stack;
+
+}
+
+/*}}}*/
+/*{{{  run_threads*/
+
+static void run_threads(const int num_threads, void *(*fn)(void *), void *arg) {
+
+  pthread_t threads[MAX_THREADS];
+
+  for (int i=0; i < num_threads; i++) {
+    if (pthread_create(&threads[i], NULL, fn, arg)) {
+      fprintf(stderr, "pthread_create failed\n");
+      exit(1);
+    }
+  }
+
+  for (int i=0; i < num_threads; i++)
+    pthread_join(threads[i], NULL);
+
+}
+
+/*}}}*/
+/*{{{  perft_expand*/
+
+// replace each task with one task per legal move, one ply deeper
+// the moves are counted first so the new tasks are allocated at their real size
+
+static int perft_expand(Node *stack, PerftTask **tasks, const int num_tasks) {
+
+  Node *node = &stack[0];
+  Node *next = &stack[1];
+
+  int num_children = 0;
+
+  for (int t=0; t < num_tasks; t++) {
+    node->pos = (*tasks)[t].pos;
+    num_children += node->pos.stm == WHITE ? count_legal_moves_white(node, &node->pos) : count_legal_moves_black(node, &node->pos);
+  }
+
+  PerftTask *children = aligned_alloc(64, (num_children ? num_children : 1) * sizeof(PerftTask));
+  if (!children) {
+    fprintf(stderr, "aligned_alloc failed for perft tasks\n");
+    exit(1);
+  }
+
+  num_children = 0;
+
+  for (int t=0; t < num_tasks; t++) {
+
+    node->pos = (*tasks)[t].pos;
+
+    gen_legal_moves(node);
+
+    for (int i=0; i < node->num_moves; i++) {
+
+      next->pos = node->pos;
+
+      make_move(&next->pos, node->moves[i]);
+
+      PerftTask *child = &children[num_children++];
+
+      child->pos   = next->pos;
+      child->depth = (*tasks)[t].depth - 1;
+      child->root  = (*tasks)[t].root;
+      child->nodes = 0;
+
+    }
+  }
+
+  free(*tasks);
+  *tasks = children;
+
+  return num_children;
+
+}
+
+/*}}}*/
+/*{{{  perft_worker*/
+
+static void *perft_worker(void *arg) {
+
+  PerftPool *pool = arg;
+  Node *stack = alloc_stack();
+
+  while (1) {
+
+    const int t = __atomic_fetch_add(&pool->next_task, 1, __ATOMIC_RELAXED);
+    if (t >= pool->num_tasks)
+      break;
+
+    PerftTask *task = &pool->tasks[t];
+
+    stack[0].pos = task->pos;
+    task->nodes = perft(stack, task->depth);
+
+  }
+
+  free(stack);
+
+  return NULL;
+
+}
+
+/*}}}*/
+/*{{{  perft_run_tasks*/
+
+// split the tasks deeper while there are too few to keep every thread busy,
+// then let the workers pull tasks until none are left - tasks may be replaced
+// and the final number of tasks is returned
+
+static int perft_run_tasks(PerftTask **tasks, int num_tasks, const int num_threads) {
+
+  if (num_tasks == 0)
+    return 0;
+
+  int task_depth = (*tasks)[0].depth;
+
+  Node *stack = alloc_stack();
+
+  while (task_depth > 1 && num_tasks > 0 && num_tasks < num_threads * PERFT_TASKS_PER_THREAD) {
+    num_tasks = perft_expand(stack, tasks, num_tasks);
+    task_depth--;
+  }
+
+  free(stack);
+
+  PerftPool pool = {*tasks, num_tasks, 0};
+
+  run_threads(num_threads, perft_worker, &pool);
+
+  return num_tasks;
+
+}
+
+/*}}}*/
+/*{{{  perft_threaded*/
+
+static uint64_t perft_threaded(Node *root, const int depth, const int num_threads) {
+
+  if (num_threads <= 1 || depth < 2)
+    return perft(root, depth);
+
+  PerftTask *tasks = aligned_alloc(64, sizeof(PerftTask));
+  if (!tasks) {
+    fprintf(stderr, "aligned_alloc failed for perft tasks\n");
+    exit(1);
+  }
+
+  tasks[0].pos   = root->pos;
+  tasks[0].depth = depth;
+  tasks[0].root  = 0;
+  tasks[0].nodes = 0;
+
+  const int num_tasks = perft_run_tasks(&tasks, 1, num_threads);
+
+  uint64_t total = 0;
+
+  for (int t=0; t < num_tasks; t++)
+    total += tasks[t].nodes;
+
+  free(tasks);
+
+  return total;
+
+}
+
+/*}}}*/
+/*{{{  divide*/
+
+// per root move subtree counts, computed on the thread pool and printed in generation order
+
+static void divide(Node *root, const int depth, const int num_threads) {
+
+  if (depth < 1)
+    return;
+
+  Node *node = &root[0];
+  Node *next = &root[1];
+
+  gen_legal_moves(node);
+
+  const int num_moves = node->num_moves;
+
+  uint32_t moves[MAX_MOVES];
+  uint64_t counts[MAX_MOVES];
+
+  PerftTask *tasks = aligned_alloc(64, (num_moves ? num_moves : 1) * sizeof(PerftTask));
+  if (!tasks) {
+    fprintf(stderr, "aligned_alloc failed for perft tasks\n");
+    exit(1);
+  }
+
+  for (int i=0; i < num_moves; i++) {
+
+    moves[i] = node->moves[i];
+    counts[i] = 0;
+
+    next->pos = node->pos;
+    make_move(&next->pos, moves[i]);
+
+    tasks[i].pos   = next->pos;
+    tasks[i].depth = depth - 1;
+    tasks[i].root  = i;
+    tasks[i].nodes = 0;
+
+  }
+
+  const double start = get_ms();
+
+  const int num_tasks = perft_run_tasks(&tasks, num_moves, num_threads);
+
+  const double elapsed_ms = get_ms() - start;
+
+  for (int t=0; t < num_tasks; t++)
+    counts[tasks[t].root] += tasks[t].nodes;
+
+  uint64_t total = 0;
+
+  for (int i=0; i < num_moves; i++) {
+
+    char buf[8];
+    format_move(moves[i], buf);
+
+    printf("%s: %llu\n", buf, (unsigned long long)counts[i]);
+
+    total += counts[i];
+
+  }
+
+  printf("\nmoves = %d, nodes = %llu\n", num_moves, (unsigned long long)total);
+  printf("time = %.2f ms,  nps = %.0f\n", elapsed_ms, elapsed_ms > 0.0 ? total / (elapsed_ms / 1000.0) : 0.0);
+
+  free(tasks);
+
+}
+
+/*}}}*/
+
+/*{{{  microbench*/
+
+static int uci_exec(char *line);
+
+static volatile uint64_t microbench_sink;  // keeps the timed results alive
+
+/*{{{  read_cycles*/
+
+static inline uint64_t read_cycles(void) {
+
+#ifdef HAVE_RDTSC
+  return __rdtsc();
+#else
+  return 0;
+#endif
+
+}
+
+/*}}}*/
+/*{{{  cmp_double*/
+
+static int cmp_double(const void *a, const void *b) {
+
+  const double x = *(const double *)a;
+  const double y = *(const double *)b;
+
+  return (x > y) - (x < y);
+
+}
+
+/*}}}*/
+/*{{{  record_positions*/
+
+// every node of a shallow legal tree, until max positions are held
+
+static void record_positions(Node *node, const int depth, Position *positions, int *num, const int max) {
+
+  if (*num >= max)
+    return;
+
+  positions[(*num)++] = node->pos;
+
+  if (depth == 0)
+    return;
+
+  Node *next = node + 1;
+
+  gen_legal_moves(node);
+
+  for (int i=0; i < node->num_moves && *num < max; i++) {
+
+    next->pos = node->pos;
+
+    make_move(&next->pos, node->moves[i]);
+
+    record_positions(next, depth-1, positions, num, max);
+
+  }
+}
+
+/*}}}*/
+/*{{{  mb_* wrappers*/
+
+// the functions under test, each called with a hot node whose position was just copied in
+
+static uint64_t mb_copy(Node *node, const uint32_t move) {
+
+  (void)move;
+
+  return node->pos.hash;
+
+}
+
+static uint64_t mb_gen_moves(Node *node, const uint32_t move) {
+
+  (void)move;
+  gen_moves(node);
+
+  return node->num_moves;
+
+}
+
+static uint64_t mb_gen_legal_moves(Node *node, const uint32_t move) {
+
+  (void)move;
+  gen_legal_moves(node);
+
+  return node->num_moves;
+
+}
+
+static uint64_t mb_gen_captures(Node *node, const uint32_t move) {
+
+  (void)move;
+  gen_captures(node);
+
+  return node->num_moves;
+
+}
+
+static uint64_t mb_gen_quiets(Node *node, const uint32_t move) {
+
+  (void)move;
+  gen_quiets(node);
+
+  return node->num_moves;
+
+}
+
+static uint64_t mb_count_legal_moves(Node *node, const uint32_t move) {
+
+  (void)move;
+
+  return node->pos.stm == WHITE ? count_legal_moves_white(node, &node->pos) : count_legal_moves_black(node, &node->pos);
+
+}
+
+static uint64_t mb_gen_pawns(Node *node, const uint32_t move) {
+
+  (void)move;
+  node->num_moves = 0;
+
+  if (node->pos.stm == WHITE)
+    gen_pawns(node, &node->pos, WHITE, ~0ULL, GEN_ALL);
+  else
+    gen_pawns(node, &node->pos, BLACK, ~0ULL, GEN_ALL);
+
+  return node->num_moves;
+
+}
+
+static uint64_t mb_gen_knights(Node *node, const uint32_t move) {
+
+  (void)move;
+  node->num_moves = 0;
+
+  if (node->pos.stm == WHITE)
+    gen_jumpers(node, &node->pos, knight_attacks, KNIGHT, WHITE, gen_target(&node->pos, WHITE, GEN_ALL));
+  else
+    gen_jumpers(node, &node->pos, knight_attacks, KNIGHT, BLACK, gen_target(&node->pos, BLACK, GEN_ALL));
+
+  return node->num_moves;
+
+}
+
+static uint64_t mb_gen_sliders(Node *node, const uint32_t move) {
+
+  (void)move;
+  node->num_moves = 0;
+
+  if (node->pos.stm == WHITE) {
+    const uint64_t target = gen_target(&node->pos, WHITE, GEN_ALL);
+    gen_sliders(node, &node->pos, bishop_attacks, BISHOP, WHITE, target);
+    gen_sliders(node, &node->pos, rook_attacks,   ROOK,   WHITE, target);
+    gen_sliders(node, &node->pos, rook_attacks,   QUEEN,  WHITE, target);
+    gen_sliders(node, &node->pos, bishop_attacks, QUEEN,  WHITE, target);
+  }
+  else {
+    const uint64_t target = gen_target(&node->pos, BLACK, GEN_ALL);
+    gen_sliders(node, &node->pos, bishop_attacks, BISHOP, BLACK, target);
+    gen_sliders(node, &node->pos, rook_attacks,   ROOK,   BLACK, target);
+    gen_sliders(node, &node->pos, rook_attacks,   QUEEN,  BLACK, target);
+    gen_sliders(node, &node->pos, bishop_attacks, QUEEN,  BLACK, target);
+  }
+
+  return node->num_moves;
+
+}
+
+static uint64_t mb_gen_king(Node *node, const uint32_t move) {
+
+  (void)move;
+  node->num_moves = 0;
+
+  if (node->pos.stm == WHITE)
+    gen_jumpers(node, &node->pos, king_attacks, KING, WHITE, gen_target(&node->pos, WHITE, GEN_ALL));
+  else
+    gen_jumpers(node, &node->pos, king_attacks, KING, BLACK, gen_target(&node->pos, BLACK, GEN_ALL));
+
+  return node->num_moves;
+
+}
+
+static uint64_t mb_gen_castling(Node *node, const uint32_t move) {
+
+  (void)move;
+  node->num_moves = 0;
+
+  if (node->pos.stm == WHITE)
+    gen_castling(node, &node->pos, WHITE, threat_map(&node->pos, WHITE));
+  else
+    gen_castling(node, &node->pos, BLACK, threat_map(&node->pos, BLACK));
+
+  return node->num_moves;
+
+}
+
+static uint64_t mb_make_move(Node *node, const uint32_t move) {
+
+  make_move(&node->pos, move);
+
+  return node->pos.hash;
+
+}
+
+static uint64_t mb_is_attacked(Node *node, const uint32_t move) {
+
+  (void)move;
+
+  const Position *pos = &node->pos;
+  const int king_sq = bsf(piece_bb(pos, KING, pos->stm));
+
+  return is_attacked(pos, king_sq, toggle(pos->stm));
+
+}
+
+static uint64_t mb_threat_map(Node *node, const uint32_t move) {
+
+  (void)move;
+
+  return node->pos.stm == WHITE ? threat_map(&node->pos, WHITE) : threat_map(&node->pos, BLACK);
+
+}
+
+static uint64_t mb_bishop_lookup(Node *node, const uint32_t move) {
+
+  (void)move;
+
+  const uint64_t occupied = occupancy(&node->pos);
+  uint64_t sum = 0;
+
+  for (int sq = 0; sq < 64; sq += 9)
+    sum ^= slider_attacks(&bishop_attacks[sq], occupied);
+
+  return sum;
+
+}
+
+static uint64_t mb_rook_lookup(Node *node, const uint32_t move) {
+
+  (void)move;
+
+  const uint64_t occupied = occupancy(&node->pos);
+  uint64_t sum = 0;
+
+  for (int sq = 0; sq < 64; sq += 9)
+    sum ^= slider_attacks(&rook_attacks[sq], occupied);
+
+  return sum;
+
+}
+
+/*}}}*/
+/*{{{  microbench_row*/
+
+// time fn over every call MICROBENCH_REPEATS times, print per call min/median
+// and return the median ns so the copy baseline can be subtracted
+
+static double microbench_row(const char *name, uint64_t (*fn)(Node *, const uint32_t), Node *node,
+                             const MicroCall *calls, const int num_calls, const int per_call, const double baseline) {
+
+  double ns[MICROBENCH_REPEATS];
+  double cycles[MICROBENCH_REPEATS];
+
+  uint64_t sink = 0;
+
+  for (int r=0; r < MICROBENCH_REPEATS; r++) {
+
+    const double start = get_ms();
+    const uint64_t start_cycles = read_cycles();
+
+    for (int i=0; i < num_calls; i++) {
+      node->pos = *calls[i].pos;
+      sink += fn(node, calls[i].move);
+    }
+
+    const uint64_t end_cycles = read_cycles();
+    const double end = get_ms();
+
+    ns[r]     = (end - start) * 1e6 / ((double)num_calls * per_call);
+    cycles[r] = (double)(end_cycles - start_cycles) / ((double)num_calls * per_call);
+
+  }
+
+  qsort(ns, MICROBENCH_REPEATS, sizeof(double), cmp_double);
+  qsort(cycles, MICROBENCH_REPEATS, sizeof(double), cmp_double);
+
+  const double median = ns[MICROBENCH_REPEATS / 2];
+
+  printf("%-22s %8d %8.1f %8.1f %8.1f", name, num_calls * per_call, ns[0], median, median - baseline / per_call);
+
+#ifdef HAVE_RDTSC
+  printf(" %8.1f %8.1f", cycles[0], cycles[MICROBENCH_REPEATS / 2]);
+#else
+  printf(" %8s %8s", "-", "-");
+#endif
+
+  printf("\n");
+
+  microbench_sink += sink;
+
+  return median;
+
+}
+
+/*}}}*/
+/*{{{  microbench*/
+
+// records positions from the bench trees and times the low level functions on them
+// net is the median less the cost of copying the Position into the hot node
+
+static void microbench(void) {
+
+  const int num_roots = sizeof(bench_tests) / sizeof(bench_tests[0]);
+  const int per_root = MICROBENCH_POSITIONS / num_roots;
+
+  Position *positions = aligned_alloc(64, MICROBENCH_POSITIONS * sizeof(Position));
+  MicroCall *calls    = malloc(MICROBENCH_POSITIONS * sizeof(MicroCall));
+  MicroCall *quiets   = malloc(MICROBENCH_POSITIONS * sizeof(MicroCall));
+  MicroCall *captures = malloc(MICROBENCH_POSITIONS * sizeof(MicroCall));
+  MicroCall *specials = malloc(MICROBENCH_POSITIONS * sizeof(MicroCall));
+  Node *stack = alloc_stack();
+
+  if (!positions || !calls || !quiets || !captures || !specials) {
+    fprintf(stderr, "alloc failed for microbench\n");
+    exit(1);
+  }
+
+  /*{{{  record*/
+  
+  int num_positions = 0;
+  
+  for (int i=0; i < num_roots; i++) {
+  
+    bench_position(&stack[0].pos, &bench_tests[i]);
+  
+    record_positions(stack, 3, positions, &num_positions, (i + 1) * per_root);
+  
+  }
+  
+  int num_quiets = 0, num_captures = 0, num_specials = 0;
+  
+  for (int i=0; i < num_positions; i++) {
+  
+    Node *node = &stack[0];
+  
+    calls[i].pos  = &positions[i];
+    calls[i].move = 0;
+  
+    node->pos = positions[i];
+    gen_legal_moves(node);
+  
+    for (int j=0; j < node->num_moves; j++) {
+  
+      const uint32_t move = node->moves[j];
+      const MicroCall call = {&positions[i], move};
+  
+      if (move & MASK_SPECIAL) {
+        if (num_specials < MICROBENCH_POSITIONS)
+          specials[num_specials++] = call;
+      }
+  
+      else if (piece_on(&positions[i], move & 0x3F) != EMPTY) {
+        if (num_captures < MICROBENCH_POSITIONS)
+          captures[num_captures++] = call;
+      }
+  
+      else if (num_quiets < MICROBENCH_POSITIONS) {
+        quiets[num_quiets++] = call;
+      }
+  
+    }
+  }
+  
+  /*}}}*/
+
+  printf("%d positions, %d repeats, ns and cycles per call\n\n", num_positions, MICROBENCH_REPEATS);
+  printf("%-22s %8s %8s %8s %8s %8s %8s\n", "function", "calls", "min", "median", "net", "cyc min", "cyc med");
+
+  Node *node = &stack[1];
+
+  const double copy = microbench_row("copy Position", mb_copy, node, calls, num_positions, 1, 0);
+
+  microbench_row("gen_moves",            mb_gen_moves,         node, calls, num_positions, 1, copy);
+  microbench_row("gen_legal_moves",      mb_gen_legal_moves,   node, calls, num_positions, 1, copy);
+  microbench_row("count_legal_moves",    mb_count_legal_moves, node, calls, num_positions, 1, copy);
+  microbench_row("gen_captures",         mb_gen_captures,      node, calls, num_positions, 1, copy);
+  microbench_row("gen_quiets",           mb_gen_quiets,        node, calls, num_positions, 1, copy);
+  microbench_row("gen_pawns",            mb_gen_pawns,         node, calls, num_positions, 1, copy);
+  microbench_row("gen_jumpers knight",   mb_gen_knights,       node, calls, num_positions, 1, copy);
+  microbench_row("gen_sliders",          mb_gen_sliders,       node, calls, num_positions, 1, copy);
+  microbench_row("gen_jumpers king",     mb_gen_king,          node, calls, num_positions, 1, copy);
+  microbench_row("gen_castling",         mb_gen_castling,      node, calls, num_positions, 1, copy);
+  microbench_row("make_move quiet",      mb_make_move,         node, quiets,   num_quiets,   1, copy);
+  microbench_row("make_move capture",    mb_make_move,         node, captures, num_captures, 1, copy);
+  microbench_row("make_move special",    mb_make_move,         node, specials, num_specials, 1, copy);
+  microbench_row("is_attacked",          mb_is_attacked,       node, calls, num_positions, 1, copy);
+  microbench_row("threat_map",           mb_threat_map,        node, calls, num_positions, 1, copy);
+  microbench_row("bishop lookup",        mb_bishop_lookup,     node, calls, num_positions, 8, copy);
+  microbench_row("rook lookup",          mb_rook_lookup,       node, calls, num_positions, 8, copy);
+
+  free(stack);
+  free(specials);
+  free(captures);
+  free(quiets);
+  free(calls);
+  free(positions);
+
+}
+
+/*}}}*/
+
+/*}}}*/
+/*{{{  perftsuite*/
+
+/*{{{  parse_epd*/
+
+// "fen ;D1 20 ;D2 400 ..." into task - returns 0 for blank or unusable lines
+
+static int parse_epd(SuiteTask *task, char *line, const int max_depth) {
+
+  char *semi = strchr(line, ';');
+  if (!semi)
+    return 0;
+
+  *semi = '\0';
+
+  if (!position_fen(&task->pos, line))
+    return 0;
+
+  strncpy(task->fen, line, sizeof(task->fen) - 1);
+  task->fen[sizeof(task->fen) - 1] = '\0';
+
+  for (int i = strlen(task->fen) - 1; i >= 0 && isspace((unsigned char)task->fen[i]); i--)
+    task->fen[i] = '\0';
+
+  memset(task->expected, 0, sizeof(task->expected));
+  memset(task->got, 0, sizeof(task->got));
+
+  task->max_depth = 0;
+
+  for (char *p = semi + 1; p; p = strchr(p, ';')) {
+
+    if (*p == ';')
+      p++;
+
+    while (isspace((unsigned char)*p))
+      p++;
+
+    int depth;
+    unsigned long long count;
+
+    if (sscanf(p, "D%d %llu", &depth, &count) == 2 && depth >= 1 && depth <= max_depth && depth <= PERFTSUITE_MAX_DEPTH) {
+      task->expected[depth] = count;
+      if (depth > task->max_depth)
+        task->max_depth = depth;
+    }
+  }
+
+  return task->max_depth > 0;
+
+}
+
+/*}}}*/
+/*{{{  suite_worker*/
+
+// whole positions per thread, each depth given in the EPD in turn
+
+static void *suite_worker(void *arg) {
+
+  SuitePool *pool = arg;
+  Node *stack = alloc_stack();
+
+  while (1) {
+
+    const int t = __atomic_fetch_add(&pool->next_task, 1, __ATOMIC_RELAXED);
+    if (t >= pool->num_tasks)
+      break;
+
+    SuiteTask *task = &pool->tasks[t];
+
+    const double start = get_ms();
+
+    task->nodes = 0;
+
+    for (int d=1; d <= task->max_depth; d++) {
+
+      if (!task->expected[d])
+        continue;
+
+      stack[0].pos = task->pos;
+
+      task->got[d] = perft(stack, d);
+      task->nodes += task->got[d];
+
+    }
+
+    task->ms = get_ms() - start;
+
+  }
+
+  free(stack);
+
+  return NULL;
+
+}
+
+/*}}}*/
+/*{{{  perftsuite*/
+
+// perftsuite <file.epd> [depth <max>] [perft options]
+// streams the file in batches run in parallel, reporting each position in file order
+
+static void perftsuite(const char *filename, const int max_depth, const int num_threads) {
+
+  FILE *file = fopen(filename, "r");
+  if (!file) {
+    printf("cannot open %s\n", filename);
+    exit_code = 1;
+    return;
+  }
+
+  SuiteTask *tasks = aligned_alloc(64, PERFTSUITE_BATCH * sizeof(SuiteTask));
+  if (!tasks) {
+    fprintf(stderr, "aligned_alloc failed for perftsuite\n");
+    exit(1);
+  }
+
+  char *line = NULL;
+  size_t cap = 0;
+
+  int line_num = 0;
+  int passed = 0, failed = 0;
+
+  uint64_t total_nodes = 0;
+
+  const double start = get_ms();
+
+  int more = 1;
+
+  while (more) {
+
+    int num_tasks = 0;
+
+    while (num_tasks < PERFTSUITE_BATCH) {
+
+      if (getline(&line, &cap, file) < 0) {
+        more = 0;
+        break;
+      }
+
+      line_num++;
+
+      SuiteTask *task = &tasks[num_tasks];
+
+      if (parse_epd(task, line, max_depth)) {
+        task->line = line_num;
+        num_tasks++;
+      }
+    }
+
+    SuitePool pool = {tasks, num_tasks, 0};
+
+    run_threads(num_threads < num_tasks ? num_threads : num_tasks, suite_worker, &pool);
+
+    for (int t=0; t < num_tasks; t++) {
+      /*{{{  report*/
+      
+      const SuiteTask *task = &tasks[t];
+      
+      int ok = 1;
+      
+      for (int d=1; d <= task->max_depth; d++) {
+        if (task->got[d] != task->expected[d]) {
+          ok = 0;
+          printf("%6d  FAIL  D%d %llu expected %llu  %s\n", task->line, d,
+                 (unsigned long long)task->got[d], (unsigned long long)task->expected[d], task->fen);
+        }
+      }
+      
+      if (ok) {
+        passed++;
+        printf("%6d  ok    D%d %12llu %9.2f ms %12.0f nps  %s\n", task->line, task->max_depth,
+               (unsigned long long)task->got[task->max_depth], task->ms,
+               task->ms > 0.0 ? task->nodes / (task->ms / 1000.0) : 0.0, task->fen);
+      }
+      else {
+        failed++;
+      }
+      
+      total_nodes += task->nodes;
+      
+      /*}}}*/
+    }
+  }
+
+  const double elapsed_ms = get_ms() - start;
+
+  printf("positions %d, passed %d, failed %d\n", passed + failed, passed, failed);
+  printf("time = %.2f ms,  nps = %.0f\n", elapsed_ms, elapsed_ms > 0.0 ? total_nodes / (elapsed_ms / 1000.0) : 0.0);
+
+  if (failed)
+    exit_code = 1;
+
+  free(line);
+  free(tasks);
+  fclose(file);
+
+}
+
+/*}}}*/
+
+/*}}}*/
+/*{{{  tt*/
+
+/*{{{  tt_resize*/
+
+// a power of two number of buckets, 2 mb aligned and advised as huge pages
+// when big enough - kept across go commands and games until the size changes
+
+static void tt_resize(int mb) {
+
+  mb = mb < 1 ? 1 : mb > TT_MAX_MB ? TT_MAX_MB : mb;
+
+  if (mb == tt_mb)
+    return;
+
+  free(tt_table);
+
+  uint64_t num_buckets = 1;
+
+  while (num_buckets * 2 * sizeof(TTBucket) <= (uint64_t)mb * 1024 * 1024)
+    num_buckets *= 2;
+
+  const size_t bytes = num_buckets * sizeof(TTBucket);
+  const size_t align = bytes >= HUGE_PAGE_SIZE ? HUGE_PAGE_SIZE : 64;
+
+  tt_table = aligned_alloc(align, bytes);
+  if (!tt_table) {
+    fprintf(stderr, "aligned_alloc failed for hash (%d mb)\n", mb);
+    exit(1);
+  }
+
+#ifdef MADV_HUGEPAGE
+  if (align == HUGE_PAGE_SIZE)
+    madvise(tt_table, bytes, MADV_HUGEPAGE);
+#endif
+
+  memset(tt_table, 0, bytes);
+
+  tt_mask = num_buckets - 1;
+  tt_mb   = mb;
+
+}
+
+/*}}}*/
+/*{{{  tt_clear*/
+
+static void tt_clear(void) {
+
+  memset(tt_table, 0, (tt_mask + 1) * sizeof(TTBucket));
+
+  tt_age = 0;
+
+}
+
+/*}}}*/
+/*{{{  tt_prefetch*/
+
+static inline __attribute__((always_inline)) void tt_prefetch(const uint64_t hash) {
+
+  __builtin_prefetch(&tt_table[hash & tt_mask]);
+
+}
+
+/*}}}*/
+/*{{{  tt_probe*/
+
+// the entry's data or 0 for a miss
+
+static inline uint64_t tt_probe(const uint64_t hash) {
+
+  const TTBucket *bucket = &tt_table[hash & tt_mask];
+
+  for (int i=0; i < TT_BUCKET_ENTRIES; i++) {
+
+    const uint64_t key  = __atomic_load_n(&bucket->entries[i].key,  __ATOMIC_RELAXED);
+    const uint64_t data = __atomic_load_n(&bucket->entries[i].data, __ATOMIC_RELAXED);
+
+    if ((key ^ data) == hash)
+      return data;
+
+  }
+
+  return 0;
+
+}
+
+/*}}}*/
+/*{{{  tt fields*/
+
+static inline __attribute__((always_inline)) uint32_t tt_move(const uint64_t data) {
+
+  return data & 0xFFFFF;
+
+}
+
+static inline __attribute__((always_inline)) int tt_score(const uint64_t data) {
+
+  return (int16_t)((data >> 20) & 0xFFFF);
+
+}
+
+static inline __attribute__((always_inline)) int tt_depth(const uint64_t data) {
+
+  return (data >> 36) & 0xFF;
+
+}
+
+static inline __attribute__((always_inline)) int tt_bound(const uint64_t data) {
+
+  return (data >> 44) & 3;
+
+}
+
+static inline __attribute__((always_inline)) int tt_entry_age(const uint64_t data) {
+
+  return (data >> 46) & 63;
+
+}
+
+/*}}}*/
+/*{{{  tt_store*/
+
+// the same position is always replaced, keeping its move if the new one has
+// none - otherwise the entry with the least depth, counting age against it
+// lock-free - another thread's half written entry fails the key check
+
+static inline void tt_store(const uint64_t hash, uint32_t move, const int score, const int depth, const int bound) {
+
+  TTBucket *bucket = &tt_table[hash & tt_mask];
+
+  int victim = 0;
+  int victim_worth = INT32_MAX;
+
+  for (int i=0; i < TT_BUCKET_ENTRIES; i++) {
+
+    const uint64_t entry_key  = __atomic_load_n(&bucket->entries[i].key,  __ATOMIC_RELAXED);
+    const uint64_t entry_data = __atomic_load_n(&bucket->entries[i].data, __ATOMIC_RELAXED);
+
+    if ((entry_key ^ entry_data) == hash) {
+      if (!move)
+        move = tt_move(entry_data);
+      victim = i;
+      break;
+    }
+
+    const int worth = entry_data ? tt_depth(entry_data) - 8 * ((tt_age - tt_entry_age(entry_data)) & 63) : -INT32_MAX;
+
+    if (worth < victim_worth) {
+      victim = i;
+      victim_worth = worth;
+    }
+  }
+
+  const uint64_t data = (uint64_t)(move & 0xFFFFF)
+                      | ((uint64_t)(uint16_t)score << 20)
+                      | ((uint64_t)depth << 36)
+                      | ((uint64_t)bound << 44)
+                      | ((uint64_t)tt_age << 46);
+
+  __atomic_store_n(&bucket->entries[victim].key,  hash ^ data, __ATOMIC_RELAXED);
+  __atomic_store_n(&bucket->entries[victim].data, data,        __ATOMIC_RELAXED);
+
+}
+
+/*}}}*/
+/*{{{  score_to_tt*/
+
+// mate scores are stored relative to the node, not the root
+
+static inline int score_to_tt(const int score, const int ply) {
+
+  return score >= MATE - MAX_PLY ? score + ply : score <= -MATE + MAX_PLY ? score - ply : score;
+
+}
+
+static inline int score_from_tt(const int score, const int ply) {
+
+  return score >= MATE - MAX_PLY ? score - ply : score <= -MATE + MAX_PLY ? score + ply : score;
+
+}
+
+/*}}}*/
+
+/*}}}*/
+/*{{{  search*/
+
+/*{{{  eval tables*/
+
+static const int piece_value[6] = {100, 320, 330, 500, 900, 0};
+
+// from white's point of view with a8 first, so white uses sq ^ 56 and black sq
+
+static const int pst[6][64] = {
+  {
+     0,   0,   0,   0,   0,   0,   0,   0,
+    50,  50,  50,  50,  50,  50,  50,  50,
+    10,  10,  20,  30,  30,  20,  10,  10,
+     5,   5,  10,  25,  25,  10,   5,   5,
+     0,   0,   0,  20,  20,   0,   0,   0,
+     5,  -5, -10,   0,   0, -10,  -5,   5,
+     5,  10,  10, -20, -20,  10,  10,   5,
+     0,   0,   0,   0,   0,   0,   0,   0
+  },
+  {
+   -50, -40, -30, -30, -30, -30, -40, -50,
+   -40, -20,   0,   0,   0,   0, -20, -40,
+   -30,   0,  10,  15,  15,  10,   0, -30,
+   -30,   5,  15,  20,  20,  15,   5, -30,
+   -30,   0,  15,  20,  20,  15,   0, -30,
+   -30,   5,  10,  15,  15,  10,   5, -30,
+   -40, -20,   0,   5,   5,   0, -20, -40,
+   -50, -40, -30, -30, -30, -30, -40, -50
+  },
+  {
+   -20, -10, -10, -10, -10, -10, -10, -20,
+   -10,   0,   0,   0,   0,   0,   0, -10,
+   -10,   0,   5,  10,  10,   5,   0, -10,
+   -10,   5,   5,  10,  10,   5,   5, -10,
+   -10,   0,  10,  10,  10,  10,   0, -10,
+   -10,  10,  10,  10,  10,  10,  10, -10,
+   -10,   5,   0,   0,   0,   0,   5, -10,
+   -20, -10, -10, -10, -10, -10, -10, -20
+  },
+  {
+     0,   0,   0,   0,   0,   0,   0,   0,
+     5,  10,  10,  10,  10,  10,  10,   5,
+    -5,   0,   0,   0,   0,   0,   0,  -5,
+    -5,   0,   0,   0,   0,   0,   0,  -5,
+    -5,   0,   0,   0,   0,   0,   0,  -5,
+    -5,   0,   0,   0,   0,   0,   0,  -5,
+    -5,   0,   0,   0,   0,   0,   0,  -5,
+     0,   0,   0,   5,   5,   0,   0,   0
+  },
+  {
+   -20, -10, -10,  -5,  -5, -10, -10, -20,
+   -10,   0,   0,   0,   0,   0,   0, -10,
+   -10,   0,   5,   5,   5,   5,   0, -10,
+    -5,   0,   5,   5,   5,   5,   0,  -5,
+     0,   0,   5,   5,   5,   5,   0,  -5,
+   -10,   5,   5,   5,   5,   5,   0, -10,
+   -10,   0,   5,   0,   0,   0,   0, -10,
+   -20, -10, -10,  -5,  -5, -10, -10, -20
+  },
+  {
+   -30, -40, -40, -50, -50, -40, -40, -30,
+   -30, -40, -40, -50, -50, -40, -40, -30,
+   -30, -40, -40, -50, -50, -40, -40, -30,
+   -30, -40, -40, -50, -50, -40, -40, -30,
+   -20, -30, -30, -40, -40, -30, -30, -20,
+   -10, -20, -20, -20, -20, -20, -20, -10,
+    20,  20,   0,   0,   0,   0,  20,  20,
+    20,  30,  10,   0,   0,  10,  30,  20
+  }
+};
+
+/*}}}*/
+/*{{{  evaluate*/
+
+// material and piece-square tables, from the side to move's point of view
+
+static int evaluate(const Position *pos) {
+
+  int score = 0;
+
+  for (int piece = PAWN; piece <= KING; piece++) {
+
+    uint64_t white = piece_bb(pos, piece, WHITE);
+    uint64_t black = piece_bb(pos, piece, BLACK);
+
+    while (white) {
+      score += piece_value[piece] + pst[piece][bsf(white) ^ 56];
+      white &= white - 1;
+    }
+
+    while (black) {
+      score -= piece_value[piece] + pst[piece][bsf(black)];
+      black &= black - 1;
+    }
+  }
+
+  return pos->stm == WHITE ? score : -score;
+
+}
+
+/*}}}*/
+/*{{{  in_check*/
+
+static int in_check(const Position *pos) {
+
+  return is_attacked(pos, bsf(piece_bb(pos, KING, pos->stm)), toggle(pos->stm));
+
+}
+
+/*}}}*/
+/*{{{  is_repetition*/
+
+// the positions since the last capture or pawn move with the same side to move,
+// back along the path from the root and then into the game before it
+
+static int is_repetition(const Search *s, const int ply) {
+
+  const Position *pos = &s->stack[ply].pos;
+
+  for (int back = 4; back <= pos->hmc; back += 2) {
+
+    const int i = ply - back;
+
+    if (i < -search_history)
+      break;
+
+    if ((i >= 0 ? s->stack[i].pos.hash : uci_game.hashes[search_history + i]) == pos->hash)
+      return 1;
+
+  }
+
+  return 0;
+
+}
+
+/*}}}*/
+/*{{{  search_nodes*/
+
+// all threads, each counter is only written by its own thread
+
+static uint64_t search_nodes(void) {
+
+  uint64_t nodes = __atomic_load_n(&search_main.nodes, __ATOMIC_RELAXED);
+
+  for (int i=0; i < search_threads - 1; i++)
+    nodes += __atomic_load_n(&search_helpers[i].nodes, __ATOMIC_RELAXED);
+
+  return nodes;
+
+}
+
+/*}}}*/
+/*{{{  check_limits*/
+
+// only the main search checks, the helpers just watch search_stop
+
+static void check_limits(const Search *s) {
+
+  if (s->id)
+    return;
+
+  if (search_limits.nodes && search_nodes() >= search_limits.nodes)
+    __atomic_store_n(&search_stop, 1, __ATOMIC_RELAXED);
+
+  if (search_hard_ms && get_ms() - search_start_ms >= search_hard_ms)
+    __atomic_store_n(&search_stop, 1, __ATOMIC_RELAXED);
+
+}
+
+/*}}}*/
+/*{{{  stopped*/
+
+static inline __attribute__((always_inline)) int stopped(void) {
+
+  return __atomic_load_n(&search_stop, __ATOMIC_RELAXED);
+
+}
+
+/*}}}*/
+/*{{{  score_moves*/
+
+// noisy moves by mvv-lva off the mailbox, promotions on top
+
+static void score_moves(const Node *node, int *scores) {
+
+  const Position *pos = &node->pos;
+
+  for (int i=0; i < node->num_moves; i++) {
+
+    const uint32_t move = node->moves[i];
+    const int victim = piece_on(pos, move & 0x3F);
+
+    int score = 0;
+
+    if (victim != EMPTY)
+      score = 100 + 10 * (victim % 6) - piece_on(pos, (move >> 6) & 0x3F) % 6;
+
+    else if (move & FLAG_EP_CAPTURE)
+      score = 100;
+
+    if (move & FLAG_PROMO)
+      score += 50 + ((move >> PROMO_SHIFT) & 3);
+
+    scores[i] = score;
+
+  }
+}
+
+/*}}}*/
+/*{{{  pick_move*/
+
+// selection sort one step - most nodes cut before the list is sorted
+
+static uint32_t pick_move(Node *node, int *scores, const int i) {
+
+  int best = i;
+
+  for (int j = i + 1; j < node->num_moves; j++) {
+    if (scores[j] > scores[best])
+      best = j;
+  }
+
+  const uint32_t move = node->moves[best];
+  const int score = scores[best];
+
+  node->moves[best] = node->moves[i];
+  scores[best] = scores[i];
+
+  node->moves[i] = move;
+  scores[i] = score;
+
+  return move;
+
+}
+
+/*}}}*/
+/*{{{  is_pseudo_legal*/
+
+// could move have been generated here, ignoring pins and checks - for the hash
+// move and killers, which are played before any generation and may come from
+// another position (a different node at the same ply or a tt collision)
+
+static int is_pseudo_legal(const Position *pos, const uint32_t move) {
+
+  const int stm  = pos->stm;
+  const int opp  = toggle(stm);
+  const int from = (move >> 6) & 0x3F;
+  const int to   = move & 0x3F;
+
+  const int index = piece_on(pos, from);
+
+  if (index == EMPTY || index / 6 != stm)
+    return 0;
+
+  const int piece = index % 6;
+  const uint64_t to_bb = 1ULL << to;
+  const uint64_t occupied = occupancy(pos);
+
+  if (pos->colour[stm] & to_bb)
+    return 0;
+
+  if (move & FLAG_CASTLE) {
+    /*{{{  castling*/
+    
+    // the destination is tested after make_move with every other move
+    
+    if (piece != KING || is_attacked(pos, from, opp))
+      return 0;
+    
+    if (stm == WHITE && from == E1 && to == G1)
+      return (pos->rights & WHITE_RIGHTS_KING) && !(occupied & 0x0000000000000060ULL) && !is_attacked(pos, F1, opp);
+    
+    if (stm == WHITE && from == E1 && to == C1)
+      return (pos->rights & WHITE_RIGHTS_QUEEN) && !(occupied & 0x000000000000000EULL) && !is_attacked(pos, D1, opp);
+    
+    if (stm == BLACK && from == E8 && to == G8)
+      return (pos->rights & BLACK_RIGHTS_KING) && !(occupied & 0x6000000000000000ULL) && !is_attacked(pos, F8, opp);
+    
+    if (stm == BLACK && from == E8 && to == C8)
+      return (pos->rights & BLACK_RIGHTS_QUEEN) && !(occupied & 0x0E00000000000000ULL) && !is_attacked(pos, D8, opp);
+    
+    return 0;
+    
+    /*}}}*/
+  }
+
+  if (piece == PAWN) {
+    /*{{{  pawns*/
+    
+    // pawn_attacks[stm][to] is where stm pawns attack to from
+    
+    const int offset = orth_offset[stm];
+    const uint64_t from_bb = 1ULL << from;
+    
+    if (move & FLAG_EP_CAPTURE)
+      return pos->ep && to == pos->ep && (pawn_attacks[stm][to] & from_bb);
+    
+    if (!(move & FLAG_PROMO) != !(to_bb & RANK_PROMO))
+      return 0;
+    
+    if (move & FLAG_PAWN_PUSH)
+      return (home_rank[stm] & from_bb) && to == from + offset + offset && !(occupied & (to_bb | (1ULL << (from + offset))));
+    
+    if (to == from + offset)
+      return !(occupied & to_bb);
+    
+    return (pawn_attacks[stm][to] & from_bb) && (pos->colour[opp] & to_bb);
+    
+    /*}}}*/
+  }
+
+  if (move & MASK_SPECIAL)
+    return 0;
+
+  uint64_t attacks = 0;
+
+  switch (piece) {
+    case KNIGHT: attacks = knight_attacks[from];                                 break;
+    case BISHOP: attacks = slider_attacks(&bishop_attacks[from], occupied);      break;
+    case ROOK:   attacks = slider_attacks(&rook_attacks[from], occupied);        break;
+    case QUEEN:  attacks = slider_attacks(&bishop_attacks[from], occupied)
+                         | slider_attacks(&rook_attacks[from], occupied);        break;
+    case KING:   attacks = king_attacks[from];                                   break;
+  }
+
+  return (attacks & to_bb) != 0;
+
+}
+
+/*}}}*/
+/*{{{  left_in_check*/
+
+// after make_move - did the side that just moved leave its king attacked
+
+static inline int left_in_check(const Position *pos) {
+
+  return is_attacked(pos, bsf(piece_bb(pos, KING, toggle(pos->stm))), pos->stm);
+
+}
+
+/*}}}*/
+/*{{{  is_quiet*/
+
+// before make_move - would gen_quiet_moves emit it - underpromotions are quiet
+// even when they capture
+
+static inline int is_quiet(const Position *pos, const uint32_t move) {
+
+  if (move & FLAG_PROMO)
+    return (move & MASK_Q_PROMO) != MASK_Q_PROMO;
+
+  return !(move & FLAG_EP_CAPTURE) && piece_on(pos, move & 0x3F) == EMPTY;
+
+}
+
+/*}}}*/
+/*{{{  init_picker*/
+
+static void init_picker(MovePicker *mp, const Search *s, const int ply, const uint32_t hash_move) {
+
+  mp->stage      = STAGE_HASH;
+  mp->index      = 0;
+  mp->pseudo     = 0;
+  mp->hash_move  = hash_move;
+  mp->killers[0] = s->killers[ply][0];
+  mp->killers[1] = s->killers[ply][1];
+
+}
+
+/*}}}*/
+/*{{{  next_move*/
+
+// the next move to search or 0 when there are none left - when mp->pseudo is
+// set the caller must reject the move if it leaves the king in check
+
+static uint32_t next_move(MovePicker *mp, Node *node) {
+
+  const Position *pos = &node->pos;
+
+  mp->pseudo = 0;
+
+  switch (mp->stage) {
+
+    case STAGE_HASH:
+
+      mp->stage = STAGE_GEN_NOISY;
+
+      if (mp->hash_move && is_pseudo_legal(pos, mp->hash_move)) {
+        mp->pseudo = 1;
+        return mp->hash_move;
+      }
+
+      // fall through
+
+    case STAGE_GEN_NOISY:
+
+      gen_noisy_moves(node);
+      score_moves(node, mp->scores);
+
+      mp->index = 0;
+      mp->stage = STAGE_NOISY;
+
+      // fall through
+
+    case STAGE_NOISY:
+
+      while (mp->index < node->num_moves) {
+        const uint32_t move = pick_move(node, mp->scores, mp->index++);
+        if (move != mp->hash_move)
+          return move;
+      }
+
+      mp->index = 0;
+      mp->stage = STAGE_KILLERS;
+
+      // fall through
+
+    case STAGE_KILLERS:
+
+      while (mp->index < 2) {
+        const uint32_t move = mp->killers[mp->index++];
+        if (move && move != mp->hash_move && is_quiet(pos, move) && is_pseudo_legal(pos, move)) {
+          mp->pseudo = 1;
+          return move;
+        }
+      }
+
+      mp->stage = STAGE_GEN_QUIET;
+
+      // fall through
+
+    case STAGE_GEN_QUIET:
+
+      gen_quiet_moves(node);
+
+      mp->index = 0;
+      mp->stage = STAGE_QUIET;
+
+      // fall through
+
+    case STAGE_QUIET:
+
+      while (mp->index < node->num_moves) {
+        const uint32_t move = node->moves[mp->index++];
+        if (move != mp->hash_move && move != mp->killers[0] && move != mp->killers[1])
+          return move;
+      }
+
+      mp->stage = STAGE_DONE;
+
+      // fall through
+
+    default:
+
+      return 0;
+
+  }
+}
+
+/*}}}*/
+/*{{{  update_killers*/
+
+static inline void update_killers(Search *s, const int ply, const uint32_t move) {
+
+  if (s->killers[ply][0] == move)
+    return;
+
+  s->killers[ply][1] = s->killers[ply][0];
+  s->killers[ply][0] = move;
+
+}
+
+/*}}}*/
+/*{{{  update_pv*/
+
+static void update_pv(Search *s, const int ply, const uint32_t move) {
+
+  s->pv[ply][0] = move;
+
+  memcpy(&s->pv[ply][1], s->pv[ply + 1], s->pv_len[ply + 1] * sizeof(uint32_t));
+
+  s->pv_len[ply] = s->pv_len[ply + 1] + 1;
+
+}
+
+/*}}}*/
+/*{{{  qsearch*/
+
+// captures and queen promotions only, standing pat on the static eval
+
+static int qsearch(Search *s, const int ply, int alpha, const int beta) {
+
+  Node *node = &s->stack[ply];
+  Node *next = node + 1;
+
+  s->pv_len[ply] = 0;
+
+  if ((++s->nodes & 1023) == 0)
+    check_limits(s);
+
+  if (stopped())
+    return 0;
+
+  const int stand_pat = evaluate(&node->pos);
+
+  if (ply >= MAX_PLY - 1 || stand_pat >= beta)
+    return stand_pat;
+
+  if (stand_pat > alpha)
+    alpha = stand_pat;
+
+  gen_captures(node);
+
+  int scores[MAX_MOVES];
+  score_moves(node, scores);
+
+  int best = stand_pat;
+
+  for (int i=0; i < node->num_moves; i++) {
+
+    const uint32_t move = pick_move(node, scores, i);
+
+    next->pos = node->pos;
+    make_move(&next->pos, move);
+
+    if (left_in_check(&next->pos))
+      continue;
+
+    const int score = -qsearch(s, ply + 1, -beta, -alpha);
+
+    if (stopped())
+      return 0;
+
+    if (score > best) {
+      best = score;
+      if (score > alpha) {
+        alpha = score;
+        update_pv(s, ply, move);
+        if (score >= beta)
+          break;
+      }
+    }
+  }
+
+  return best;
+
+}
+
+/*}}}*/
+/*{{{  search*/
+
+// negamax alpha-beta on the Node stack, copy-make like perft
+
+static int search(Search *s, const int ply, int depth, int alpha, const int beta) {
+
+  Node *node = &s->stack[ply];
+  Node *next = node + 1;
+
+  const int check = in_check(&node->pos);
+
+  if (check)
+    depth++;
+
+  if (depth <= 0)
+    return qsearch(s, ply, alpha, beta);
+
+  s->pv_len[ply] = 0;
+
+  if ((++s->nodes & 1023) == 0)
+    check_limits(s);
+
+  if (stopped())
+    return 0;
+
+  if (ply && (node->pos.hmc >= 100 || is_repetition(s, ply)))
+    return 0;
+
+  if (ply >= MAX_PLY - 1)
+    return evaluate(&node->pos);
+
+  /*{{{  tt*/
+  
+  // no cutoffs in pv nodes, they would cut the pv short
+  
+  const int pv_node = beta - alpha > 1;
+  const uint64_t tt_data = tt_probe(node->pos.hash);
+  
+  uint32_t hash_move = ply < s->prev_pv_len ? s->prev_pv[ply] : 0;
+  
+  if (tt_data) {
+  
+    if (tt_move(tt_data))
+      hash_move = tt_move(tt_data);
+  
+    if (ply && !pv_node && tt_depth(tt_data) >= depth) {
+  
+      const int score = score_from_tt(tt_score(tt_data), ply);
+      const int bound = tt_bound(tt_data);
+  
+      if (bound == TT_EXACT || (bound == TT_LOWER && score >= beta) || (bound == TT_UPPER && score <= alpha))
+        return score;
+  
+    }
+  }
+  
+  /*}}}*/
+
+  MovePicker mp;
+  init_picker(&mp, s, ply, hash_move);
+
+  const int orig_alpha = alpha;
+
+  int best = -INFINITE;
+  uint32_t best_move = 0;
+  int played = 0;
+
+  uint32_t move;
+
+  while ((move = next_move(&mp, node))) {
+
+    next->pos = node->pos;
+    make_move(&next->pos, move);
+
+    if (mp.pseudo && left_in_check(&next->pos))
+      continue;
+
+    played++;
+
+    tt_prefetch(next->pos.hash);
+
+    const int score = -search(s, ply + 1, depth - 1, -beta, -alpha);
+
+    if (stopped())
+      return 0;
+
+    if (score > best) {
+      best = score;
+      best_move = move;
+      if (score > alpha) {
+        alpha = score;
+        update_pv(s, ply, move);
+        if (score >= beta) {
+          if (is_quiet(&node->pos, move))
+            update_killers(s, ply, move);
+          break;
+        }
+      }
+    }
+  }
+
+  if (!played)
+    return check ? -MATE + ply : 0;
+
+  const int bound = best >= beta ? TT_LOWER : best > orig_alpha ? TT_EXACT : TT_UPPER;
+
+  tt_store(node->pos.hash, best > orig_alpha ? best_move : 0, score_to_tt(best, ply), depth, bound);
+
+  return best;
+
+}
+
+/*}}}*/
+/*{{{  print_info*/
+
+static void print_info(const Search *s, const int depth, const int score) {
+
+  if (search_quiet)
+    return;
+
+  const double elapsed_ms = get_ms() - search_start_ms;
+  const uint64_t nodes = search_nodes();
+  const uint64_t nps = elapsed_ms > 0 ? (uint64_t)(nodes / (elapsed_ms / 1000.0)) : 0;
+
+  char score_str[32];
+
+  if (score >= MATE - MAX_PLY)
+    snprintf(score_str, sizeof(score_str), "mate %d", (MATE - score + 1) / 2);
+  else if (score <= -MATE + MAX_PLY)
+    snprintf(score_str, sizeof(score_str), "mate -%d", (MATE + score) / 2);
+  else
+    snprintf(score_str, sizeof(score_str), "cp %d", score);
+
+  printf("info depth %d score %s nodes %llu nps %llu time %.0f pv",
+         depth, score_str, (unsigned long long)nodes, (unsigned long long)nps, elapsed_ms);
+
+  for (int i=0; i < s->pv_len[0]; i++) {
+    char buf[8];
+    format_move(s->pv[0][i], buf);
+    printf(" %s", buf);
+  }
+
+  printf("\n");
+
+}
+
+/*}}}*/
+/*{{{  iterate*/
+
+// iterative deepening - only completed iterations change the best move
+// odd helpers start a ply deeper so the threads spread over two depths
+
+static void iterate(Search *s) {
+
+  s->depth       = 0;
+  s->best_score  = 0;
+  s->prev_pv_len = 0;
+
+  memset(s->killers, 0, sizeof(s->killers));
+
+  gen_legal_moves(&s->stack[0]);
+
+  if (!s->stack[0].num_moves) {
+    s->best_move = 0;
+    if (!s->id && !search_quiet)
+      printf("info depth 0 score %s\n", in_check(&s->stack[0].pos) ? "mate 0" : "cp 0");
+    return;
+  }
+
+  s->best_move = s->stack[0].moves[0];
+
+  const int max_depth = search_limits.depth ? (search_limits.depth < MAX_DEPTH ? search_limits.depth : MAX_DEPTH) : MAX_DEPTH;
+
+  for (int depth = 1 + (s->id & 1); depth <= max_depth; depth++) {
+
+    const int score = search(s, 0, depth, -INFINITE, INFINITE);
+
+    if (stopped())
+      break;
+
+    s->depth      = depth;
+    s->best_score = score;
+
+    if (s->pv_len[0]) {
+      s->best_move = s->pv[0][0];
+      memcpy(s->prev_pv, s->pv[0], s->pv_len[0] * sizeof(uint32_t));
+      s->prev_pv_len = s->pv_len[0];
+    }
+
+    if (s->id)
+      continue;
+
+    print_info(s, depth, score);
+
+    if (search_soft_ms && get_ms() - search_start_ms >= search_soft_ms)
+      break;
+
+  }
+}
+
+/*}}}*/
+/*{{{  search_helper*/
+
+static void *search_helper(void *arg) {
+
+  iterate((Search *)arg);
+
+  return NULL;
+
+}
+
+/*}}}*/
+/*{{{  search_go*/
+
+// search thread - runs the main search while the helpers run theirs, then
+// reports the deepest completed result, the main one on a tie
+// bestmove waits for stop in infinite mode as uci requires
+
+static void *search_go(void *arg) {
+
+  Search *s = (Search *)arg;
+
+  pthread_t helpers[MAX_THREADS];
+
+  s->nodes = 0;
+
+  for (int i=0; i < search_threads - 1; i++) {
+
+    Search *h = &search_helpers[i];
+
+    h->stack[0].pos = s->stack[0].pos;
+    h->nodes = 0;
+
+    if (pthread_create(&helpers[i], NULL, search_helper, h)) {
+      fprintf(stderr, "pthread_create failed\n");
+      exit(1);
+    }
+  }
+
+  iterate(s);
+
+  if (search_limits.infinite) {
+    const struct timespec wait = {0, 1000000};
+    while (!stopped())
+      nanosleep(&wait, NULL);
+  }
+
+  __atomic_store_n(&search_stop, 1, __ATOMIC_RELAXED);
+
+  const Search *best = s;
+
+  for (int i=0; i < search_threads - 1; i++) {
+
+    pthread_join(helpers[i], NULL);
+
+    if (search_helpers[i].depth > best->depth && search_helpers[i].best_move)
+      best = &search_helpers[i];
+
+  }
+
+  if (!search_quiet) {
+
+    char buf[8] = "0000";
+
+    if (best->best_move)
+      format_move(best->best_move, buf);
+
+    printf("bestmove %s\n", buf);
+
+  }
+
+  return NULL;
+
+}
+
+/*}}}*/
+/*{{{  search_set_threads*/
+
+// the main search plus threads-1 helpers, each with its own Node stack
+
+static void search_set_threads(int threads) {
+
+  threads = threads < 1 ? 1 : threads > MAX_THREADS ? MAX_THREADS : threads;
+
+  for (int i=0; i < search_threads - 1; i++)
+    free(search_helpers[i].stack);
+
+  free(search_helpers);
+
+  search_helpers = NULL;
+  search_threads = threads;
+
+  if (threads == 1)
+    return;
+
+  search_helpers = aligned_alloc(64, (threads - 1) * sizeof(Search));
+  if (!search_helpers) {
+    fprintf(stderr, "aligned_alloc failed for search threads\n");
+    exit(1);
+  }
+
+  for (int i=0; i < threads - 1; i++) {
+    memset(&search_helpers[i], 0, sizeof(Search));
+    search_helpers[i].stack = alloc_stack();
+    search_helpers[i].id = i + 1;
+  }
+}
+
+/*}}}*/
+/*{{{  search_launch*/
+
+// start the search thread on ss[0] with search_limits and the time limits set
+
+static void search_launch(void) {
+
+  search_start_ms = get_ms();
+  search_main.stack = ss;
+
+  // the game only leads to ss[0] if no other command has reused it since
+  search_history = ss[0].pos.hash == uci_game.pos.hash ? uci_game.num_moves : 0;
+
+  tt_age = (tt_age + 1) & 63;
+
+  __atomic_store_n(&search_stop, 0, __ATOMIC_RELAXED);
+
+  if (pthread_create(&search_thread, NULL, search_go, &search_main)) {
+    fprintf(stderr, "pthread_create failed\n");
+    exit(1);
+  }
+
+  search_running = 1;
+
+}
+
+/*}}}*/
+/*{{{  search_start*/
+
+// go [depth <d>] [nodes <n>] [movetime <ms>] [wtime <ms>] [btime <ms>] [winc <ms>] [binc <ms>] [movestogo <n>] [infinite]
+
+static void search_start(const int n, char **tokens) {
+
+  SearchLimits *l = &search_limits;
+
+  memset(l, 0, sizeof(SearchLimits));
+
+  for (int i=1; i < n; i++) {
+
+    const char *value = i + 1 < n ? tokens[i+1] : "0";
+
+    if      (!strcmp(tokens[i], "depth"))     l->depth     = atoi(value);
+    else if (!strcmp(tokens[i], "nodes"))     l->nodes     = strtoull(value, NULL, 10);
+    else if (!strcmp(tokens[i], "movetime"))  l->movetime  = atoi(value);
+    else if (!strcmp(tokens[i], "wtime"))     l->wtime     = atoi(value);
+    else if (!strcmp(tokens[i], "btime"))     l->btime     = atoi(value);
+    else if (!strcmp(tokens[i], "winc"))      l->winc      = atoi(value);
+    else if (!strcmp(tokens[i], "binc"))      l->binc      = atoi(value);
+    else if (!strcmp(tokens[i], "movestogo")) l->movestogo = atoi(value);
+    else if (!strcmp(tokens[i], "infinite"))  l->infinite  = 1;
+
+  }
+
+  /*{{{  time allocation*/
+  
+  const int stm  = ss[0].pos.stm;
+  const int time = stm == WHITE ? l->wtime : l->btime;
+  const int inc  = stm == WHITE ? l->winc  : l->binc;
+  
+  search_soft_ms = 0;
+  search_hard_ms = 0;
+  
+  if (l->movetime) {
+    search_soft_ms = l->movetime;
+    search_hard_ms = l->movetime;
+  }
+  
+  else if (time && !l->infinite) {
+  
+    const double alloc = time / (double)(l->movestogo ? l->movestogo : 30) + inc * 0.75;
+    const double most  = time - MOVE_OVERHEAD_MS > 1 ? time - MOVE_OVERHEAD_MS : 1;
+  
+    search_hard_ms = alloc < most ? alloc : most;
+    search_soft_ms = search_hard_ms / 2;
+  
+  }
+  
+  /*}}}*/
+
+  search_launch();
+
+}
+
+/*}}}*/
+/*{{{  search_wait*/
+
+// let a running search finish - the end of a script or of stdin
+
+static void search_wait(void) {
+
+  if (!search_running)
+    return;
+
+  if (search_limits.infinite)
+    __atomic_store_n(&search_stop, 1, __ATOMIC_RELAXED);
+
+  pthread_join(search_thread, NULL);
+
+  search_running = 0;
+
+}
+
+/*}}}*/
+/*{{{  search_halt*/
+
+// stop a running search, it still prints bestmove
+
+static void search_halt(void) {
+
+  if (!search_running)
+    return;
+
+  __atomic_store_n(&search_stop, 1, __ATOMIC_RELAXED);
+
+  search_wait();
+
+}
+
+/*}}}*/
+/*{{{  smp_bench*/
+
+// time to depth and nps over the bench positions for 1, 2, 4, 8 and 16 threads,
+// with the tt cleared before each search so every run starts the same
+
+static void smp_bench(const int depth) {
+
+  static const int counts[] = {1, 2, 4, 8, 16};
+
+  const int num_counts = sizeof(counts) / sizeof(counts[0]);
+  const int num_tests  = sizeof(bench_tests) / sizeof(bench_tests[0]);
+
+  const int saved_threads = search_threads;
+  const Position saved = ss[0].pos;
+
+  double base_ms  = 0;
+  double base_nps = 0;
+
+  printf("depth %d, %d positions\n\n", depth, num_tests);
+  printf("threads    time ms        nodes          nps  ttd speedup  nps scaling\n");
+
+  for (int c=0; c < num_counts; c++) {
+
+    search_set_threads(counts[c]);
+
+    uint64_t total_nodes = 0;
+    double total_ms = 0;
+
+    for (int i=0; i < num_tests; i++) {
+
+      bench_position(&ss[0].pos, &bench_tests[i]);
+      tt_clear();
+
+      memset(&search_limits, 0, sizeof(SearchLimits));
+      search_limits.depth = depth;
+
+      search_soft_ms = 0;
+      search_hard_ms = 0;
+      search_quiet   = 1;
+
+      const double start = get_ms();
+
+      search_launch();
+      search_wait();
+
+      total_ms    += get_ms() - start;
+      total_nodes += search_nodes();
+
+      search_quiet = 0;
+
+    }
+
+    const double nps = total_ms > 0 ? total_nodes / (total_ms / 1000.0) : 0;
+
+    if (c == 0) {
+      base_ms  = total_ms;
+      base_nps = nps;
+    }
+
+    printf("%7d %10.0f %12llu %12.0f %12.2f %12.2f\n",
+           counts[c], total_ms, (unsigned long long)total_nodes, nps,
+           total_ms > 0 ? base_ms / total_ms : 0.0, base_nps > 0 ? nps / base_nps : 0.0);
+
+  }
+
+  search_set_threads(saved_threads);
+
+  ss[0].pos = saved;
+
+}
+
+/*}}}*/
+
+/*}}}*/
+/*{{{  print_stats*/
+
+// print and reset the hot path counters
+
+static void print_stats(void) {
+
+#ifdef STATS
+
+  const char *kinds[MOVE_KINDS] = {"quiet", "capture", "push", "ep", "castle", "promo"};
+
+  uint64_t nodes = 0, moves = 0, made = 0;
+
+  for (int i=0; i <= MAX_MOVES; i++) {
+    nodes += stats.num_moves[i];
+    moves += stats.num_moves[i] * i;
+  }
+
+  for (int k=0; k < MOVE_KINDS; k++)
+    made += stats.make_move[k];
+
+  printf("gen_pawns       %14llu\n", (unsigned long long)stats.gen_pawns);
+  printf("gen_jumpers     %14llu\n", (unsigned long long)stats.gen_jumpers);
+  printf("gen_sliders     %14llu\n", (unsigned long long)stats.gen_sliders);
+  printf("gen_castling    %14llu\n", (unsigned long long)stats.gen_castling);
+  printf("gen_legal       %14llu\n", (unsigned long long)stats.gen_legal);
+  printf("is_attacked     %14llu\n", (unsigned long long)stats.is_attacked);
+
+  printf("make_move       %14llu\n", (unsigned long long)made);
+
+  for (int k=0; k < MOVE_KINDS; k++)
+    printf("  %-13s %14llu %6.2f%%\n", kinds[k], (unsigned long long)stats.make_move[k], made ? 100.0 * stats.make_move[k] / made : 0.0);
+
+  printf("perft pseudo    %14llu\n", (unsigned long long)stats.perft_pseudo);
+  printf("  tested        %14llu %6.2f%%\n", (unsigned long long)stats.perft_tested,
+         stats.perft_pseudo ? 100.0 * stats.perft_tested / stats.perft_pseudo : 0.0);
+  printf("  rejected      %14llu %6.2f%%\n", (unsigned long long)stats.perft_rejected,
+         stats.perft_pseudo ? 100.0 * stats.perft_rejected / stats.perft_pseudo : 0.0);
+
+  printf("generated nodes %14llu, %.2f moves per node\n", (unsigned long long)nodes, nodes ? (double)moves / nodes : 0.0);
+
+  for (int lo=0; lo <= MAX_MOVES; lo += 10) {
+
+    uint64_t count = 0;
+
+    for (int i=lo; i < lo + 10 && i <= MAX_MOVES; i++)
+      count += stats.num_moves[i];
+
+    if (count)
+      printf("  %3d-%-3d       %14llu %6.2f%%\n", lo, lo + 9, (unsigned long long)count, 100.0 * count / nodes);
+
+  }
+
+  memset(&stats, 0, sizeof(stats));
+
+#else
+
+  printf("stats are not compiled in, use make BUILD=stats\n");
+
+#endif
+
+}
+
+/*}}}*/
+/*{{{  parse_perft_opts*/
+
+// [threads <n>] [hash <mb>] [gen legal|pseudo] [bulk on|off] [unmake on|off] anywhere in tokens[first..n-1]
+// the result also becomes the active perft_opts
+
+static void parse_perft_opts(const int n, char **tokens, const int first, PerftOpts *opts) {
+
+  opts->threads = 1;
+  opts->hash_mb = 0;
+  opts->legal   = 1;
+  opts->bulk    = 1;
+  opts->unmake  = 0;
+
+  for (int i=first; i < n-1; i++) {
+
+    if (!strcmp(tokens[i], "threads"))
+      opts->threads = atoi(tokens[i+1]);
+
+    else if (!strcmp(tokens[i], "hash"))
+      opts->hash_mb = atoi(tokens[i+1]);
+
+    else if (!strcmp(tokens[i], "gen"))
+      opts->legal = strcmp(tokens[i+1], "pseudo") != 0;
+
+    else if (!strcmp(tokens[i], "bulk"))
+      opts->bulk = strcmp(tokens[i+1], "off") != 0;
+
+    else if (!strcmp(tokens[i], "unmake"))
+      opts->unmake = strcmp(tokens[i+1], "on") == 0;
+
+  }
+
+  opts->threads = opts->threads < 1 ? 1 : opts->threads > MAX_THREADS ? MAX_THREADS : opts->threads;
+  opts->hash_mb = opts->hash_mb < 0 ? 0 : opts->hash_mb;
+
+  perft_hash_resize(opts->hash_mb);
+  perft_hash_clear();
+
+  perft_opts = *opts;
+
+}
+
+/*}}}*/
+/*{{{  uci_position*/
+
+/*{{{  parse_move*/
+
+// uci notation to one of node's legal moves, 0 if there is no such move
+
+static uint32_t parse_move(Node *node, const char *str) {
+
+  gen_legal_moves(node);
+
+  for (int i=0; i < node->num_moves; i++) {
+
+    char buf[8];
+    format_move(node->moves[i], buf);
+
+    if (!strcmp(buf, str))
+      return node->moves[i];
+
+  }
+
+  return 0;
+
+}
 
 /*}}}*/
+/*{{{  join_tokens*/
 
-static void make_move(Position * __restrict pos, const uint64_t move) {
+// tokens[first..last-1] space separated, in a malloced string
 
-  const int from = (move >> 6) & 0x3F;
-  const int to   = move & 0x3F;
+static char *join_tokens(char **tokens, const int first, const int last) {
 
-  const uint64_t from_bb = 1ULL << from;
-  const uint64_t to_bb   = 1ULL << to;
+  size_t len = 1;
 
-  const int stm = pos->stm;
-  const int opp = toggle(stm);
+  for (int i=first; i < last; i++)
+    len += strlen(tokens[i]) + 1;
 
-  const int from_piece = pos->board[from];
-  const int to_piece   = pos->board[to];
+  char *str = malloc(len);
+  if (!str) {
+    fprintf(stderr, "malloc failed for uci tokens\n");
+    exit(1);
+  }
 
-  /*{{{  remove from piece*/
-  
-  pos->all[from_piece] &= ~from_bb;
-  pos->colour[stm]     &= ~from_bb;
-  
-  pos->board[from] = EMPTY;
-  
-  /*}}}*/
+  char *p = str;
+  *p = '\0';
 
-  if (to_piece != EMPTY) {
-    /*{{{  remove to piece*/
-    
-    pos->all[to_piece] &= ~to_bb;
-    pos->colour[opp]   &= ~to_bb;
-    
-    /*}}}*/
-  }
+  for (int i=first; i < last; i++) {
 
-  /*{{{  move from piece*/
-  
-  pos->all[from_piece] |= to_bb;
-  pos->colour[stm]     |= to_bb;
-  
-  pos->board[to] = from_piece;
-  
-  /*}}}*/
+    if (i > first)
+      *p++ = ' ';
 
-  pos->ep = 0;
-  pos->rights &= rights_mask[from] & rights_mask[to];
+    const size_t n = strlen(tokens[i]);
+    memcpy(p, tokens[i], n + 1);
+    p += n;
 
-  if (move & MASK_SPECIAL) {
-    /*{{{  specials*/
-    
-    // hack - use an indirect func call? measure it - maybe different make_move versions
-    
-    if (move & FLAG_PROMO) {
-      /*{{{  promo*/
-      
-      const int pro = piece_index(((move >> PROMO_SHIFT) & 3) + 1, stm);
-      
-      pos->all[from_piece] &= ~to_bb;
-      pos->all[pro]        |= to_bb;
-      
-      pos->board[to] = pro;
-      
-      /*}}}*/
-    }
-    
-    else if (move & FLAG_EP_CAPTURE) {
-      /*{{{  ep*/
-      
-      const int pawn_sq = to + orth_offset[opp];
-      const uint64_t pawn_bb = 1ULL << pawn_sq;
-      
-      pos->all[piece_index(PAWN, opp)] &= ~pawn_bb;
-      pos->colour[opp] &= ~pawn_bb;
-      pos->board[pawn_sq] = EMPTY;
-      
-      /*}}}*/
-    }
-    
-    else if (move & FLAG_PAWN_PUSH) {
-      /*{{{  set ep*/
-      
-      pos->ep = from + orth_offset[stm];
-      
-      /*}}}*/
-    }
-    
-    else if (move & FLAG_CASTLE) {
-      /*{{{  castle*/
-      
-      const int rook = piece_index(ROOK, stm);
-      
-      uint64_t rook_from_bb = 1ULL << rook_from[to];
-      uint64_t rook_to_bb   = 1ULL << rook_to[to];
-      
-      pos->all[rook]   &= ~rook_from_bb;
-      pos->colour[stm] &= ~rook_from_bb;
-      pos->board[rook_from[to]] = EMPTY;
-      
-      pos->all[rook]   |= rook_to_bb;
-      pos->colour[stm] |= rook_to_bb;
-      pos->board[rook_to[to]] = rook;
-      
-      /*}}}*/
-    }
-    
-    
-    /*}}}*/
   }
 
-  pos->occupied = pos->colour[WHITE] | pos->colour[BLACK];
-  pos->stm = opp;
+  return str;
 
 }
 
 /*}}}*/
 
-/*{{{  perft*/
+// position startpos|s|fen|f [<fen>] [moves <m1> <m2> ...]
+// when the base matches the last command and its moves start with the ones
+// already applied, only the new moves are played on the saved position
 
-static uint64_t perft(int ply, int depth) {
+static void uci_position(const int n, char **tokens) {
 
-  if (depth == 0)
-    return 1;
+  if (n < 2)
+    return;
 
-  Node *node = &ss[ply];
-  Node *next = &ss[ply+1];
+  const char *sub = tokens[1];
 
-  gen_moves(node);
+  const int startpos = !strcmp(sub, "startpos") || !strcmp(sub, "s");
+  const int fen      = !strcmp(sub, "fen")      || !strcmp(sub, "f");
 
-  const int stm = node->pos.stm;
-  const int opp = toggle(stm);
+  if (!startpos && !fen) {
+    printf("?\n");
+    return;
+  }
 
-  const int king = piece_index(KING, stm);
+  int moves_at = 2;
 
-  uint64_t total_searched = 0;
+  while (moves_at < n && strcmp(tokens[moves_at], "moves"))
+    moves_at++;
 
-  for (int i=0; i < node->num_moves; i++) {
+  if (fen && moves_at - 2 < 4) {
+    printf("position fen needs board, stm, rights and ep\n");
+    return;
+  }
 
-    next->pos = node->pos;
+  char *base  = startpos ? strdup("startpos") : join_tokens(tokens, 2, moves_at);
+  char *moves = join_tokens(tokens, moves_at + 1, n);
 
-    make_move(&next->pos, node->moves[i]);
+  const size_t applied_len = uci_game.moves ? strlen(uci_game.moves) : 0;
 
-    int king_sq = bsf(next->pos.all[king]);
-    if (is_attacked(&next->pos, king_sq, opp)) {
-      continue;
+  int first = moves_at + 1;
+
+  if (uci_game.base && !strcmp(uci_game.base, base) &&
+      !strncmp(uci_game.moves, moves, applied_len) &&
+      (moves[applied_len] == ' ' || moves[applied_len] == '\0' || applied_len == 0)) {
+    /*{{{  extends the last one*/
+    
+    ss[0].pos = uci_game.pos;
+    
+    first += uci_game.num_moves;
+    
+    /*}}}*/
+  }
+
+  else if (startpos) {
+    position(&ss[0].pos, "rnbqkbnr/pppppppp/8/8/8/8/PPPPPPPP/RNBQKBNR", "w", "KQkq", "-");
+  }
+
+  else {
+    position(&ss[0].pos, tokens[2], tokens[3], tokens[4], tokens[5]);
+    if (moves_at - 2 > 4) {
+      const long hmc = strtol(tokens[6], NULL, 10);  // clamped, a byte would wrap
+      ss[0].pos.hmc = hmc < 0 ? 0 : hmc > 100 ? 100 : hmc;
     }
+  }
 
-    uint64_t nodes_searched = perft(ply+1, depth-1);
+  free(uci_game.base);
+  free(uci_game.moves);
 
-    total_searched += nodes_searched;
+  uci_game.base  = base;
+  uci_game.moves = moves;
 
+  const int num_moves = n - moves_at - 1 > 0 ? n - moves_at - 1 : 0;
+
+  if (num_moves > uci_game.max_hashes) {
+    uci_game.hashes = realloc(uci_game.hashes, num_moves * sizeof(uint64_t));
+    if (!uci_game.hashes) {
+      fprintf(stderr, "realloc failed for the game history\n");
+      exit(1);
+    }
+    uci_game.max_hashes = num_moves;
   }
 
-  return total_searched;
+  for (int i=first; i < n; i++) {
+
+    const uint32_t move = parse_move(&ss[0], tokens[i]);
+
+    if (!move) {
+      /*{{{  stop at an illegal move and forget the game*/
+      
+      printf("info string illegal move %s\n", tokens[i]);
+      
+      free(uci_game.base);
+      free(uci_game.moves);
+      
+      uci_game.base  = NULL;
+      uci_game.moves = NULL;
+      
+      uci_game.num_moves = 0;
+      
+      return;
+      
+      /*}}}*/
+    }
+
+    uci_game.hashes[i - moves_at - 1] = ss[0].pos.hash;
+
+    make_move(&ss[0].pos, move);
+
+  }
+
+  uci_game.num_moves = num_moves;
+  uci_game.pos = ss[0].pos;
 
 }
 
 /*}}}*/
-
 /*{{{  uci_tokens*/
 
-static int uci_exec(char *line);
-
 static int uci_tokens(int n, char **tokens) {
 
   if (n == 0)
@@ -1381,28 +5382,11 @@ static int uci_tokens(int n, char **tokens) {
     /*}}}*/
   }
 
-  if (!strcmp(cmd, "position") || !strcmp(cmd, "p")) {
+  else if (!strcmp(cmd, "position") || !strcmp(cmd, "p")) {
     /*{{{  position*/
     
-    if (!strcmp(sub, "startpos") || !strcmp(sub, "s")) {
-    
-      position(&ss[0].pos, "rnbqkbnr/pppppppp/8/8/8/8/PPPPPPPP/RNBQKBNR", "w", "KQkq", "-");
-    
-      //if (n > 2 && !strcmp(tokens[2],"moves")) {
-        //for (int i=3; i < n; i++)
-          //playMove(tokens[i]);
-      //}
-    }
-    
-    else if (!strcmp(sub, "fen") || !strcmp(sub, "f") ) {
-    
-      position(&ss[0].pos, tokens[2], tokens[3], tokens[4], tokens[5]);
-    
-      //if (n > 8 && !strcmp(tokens[8],"moves")) {
-        //for (int i=9; i < n; i++)
-          //playMove(tokens[i]);
-      //}
-    }
+    search_halt();
+    uci_position(n, tokens);
     
     /*}}}*/
   }
@@ -1412,6 +5396,8 @@ static int uci_tokens(int n, char **tokens) {
     
     printf("id name Lozza 8c\n");
     printf("id author Colin Jenkins\n");
+    printf("option name Hash type spin default %d min 1 max %d\n", TT_DEFAULT_MB, TT_MAX_MB);
+    printf("option name Threads type spin default 1 min 1 max %d\n", MAX_THREADS);
     printf("uciok\n");
     
     /*}}}*/
@@ -1420,6 +5406,8 @@ static int uci_tokens(int n, char **tokens) {
   else if (!strcmp(cmd, "b")) {
     /*{{{  board*/
     
+    search_halt();
+    
     print_board(&ss[0].pos);
     
     /*}}}*/
@@ -1428,31 +5416,14 @@ static int uci_tokens(int n, char **tokens) {
   else if (!strcmp(cmd, "m")) {
     /*{{{  moves*/
     
-    Node *node = &ss[0];
-    Node *next = &ss[1];
-    
-    gen_moves(node);
-    
-    const int stm = node->pos.stm;
-    const int opp = toggle(stm);
-    
-    for (int i=0; i < node->num_moves; i++) {
-    
-      memcpy(&next->pos, &node->pos, sizeof(Position));
-    
-      uint32_t move = node->moves[i];
-    
-      make_move(&next->pos, move);
-    
-      int king_sq = bsf(next->pos.all[piece_index(KING, stm)]);
+    search_halt();
     
-      if (is_attacked(&next->pos, king_sq, opp)) {
-        continue;
-      }
+    Node *node = &ss[0];
     
-      pp_move(move);
+    gen_legal_moves(node);
     
-    }
+    for (int i=0; i < node->num_moves; i++)
+      pp_move(node->moves[i]);
     
     /*}}}*/
   }
@@ -1460,12 +5431,18 @@ static int uci_tokens(int n, char **tokens) {
   else if (!strcmp(cmd, "perft") || !strcmp(cmd, "f")) {
     /*{{{  perft*/
     
+    search_halt();
+    
     const int depth = atoi(sub);
+    
+    PerftOpts opts;
+    parse_perft_opts(n, tokens, 2, &opts);
+    
     double start = get_ms();
     uint64_t total_nodes = 0;
     
     for (int d=0; d <= depth; d++) {
-      uint64_t num_nodes = perft(0, d);
+      uint64_t num_nodes = perft_threaded(&ss[0], d, opts.threads);
       total_nodes += num_nodes;
       printf("perft(%d) = %llu\n", d, (unsigned long long)num_nodes);
     }
@@ -1480,11 +5457,34 @@ static int uci_tokens(int n, char **tokens) {
     /*}}}*/
   }
 
+  else if (!strcmp(cmd, "divide")) {
+    /*{{{  divide*/
+    
+    search_halt();
+    
+    if (n < 2) {
+      printf("divide <depth> [threads <n>] [hash <mb>] [gen legal|pseudo] [bulk on|off]\n");
+      return 0;
+    }
+    
+    PerftOpts opts;
+    parse_perft_opts(n, tokens, 2, &opts);
+    
+    divide(&ss[0], atoi(sub), opts.threads);
+    
+    /*}}}*/
+  }
+
   else if (!strcmp(cmd, "pt")) {
     /*{{{  perft tests*/
     
+    search_halt();
+    
     const int num_tests = 64;
     
+    PerftOpts opts;
+    parse_perft_opts(n, tokens, 1, &opts);
+    
     double start = get_ms();
     
     uint64_t total_nodes = 0;
@@ -1499,7 +5499,7 @@ static int uci_tokens(int n, char **tokens) {
     
       int r = uci_exec(line);
     
-      uint64_t num_nodes = perft(0, test->depth);
+      uint64_t num_nodes = perft_threaded(&ss[0], test->depth, opts.threads);
       total_nodes += num_nodes;
     
       printf("%s %d %llu %llu (%lu)\n",
@@ -1521,9 +5521,190 @@ static int uci_tokens(int n, char **tokens) {
     /*}}}*/
   }
 
-  else if (!strcmp(cmd, "q")) {
+  else if (!strcmp(cmd, "bench")) {
+    /*{{{  bench*/
+    
+    // bench [perft options] - the position is restored afterwards and
+    // any wrong count fails the process, for scripted regression runs
+    
+    search_halt();
+    
+    const int num_tests = sizeof(bench_tests) / sizeof(bench_tests[0]);
+    
+    PerftOpts opts;
+    parse_perft_opts(n, tokens, 1, &opts);
+    
+    const Position saved = ss[0].pos;
+    
+    uint64_t total_nodes = 0;
+    double total_ms = 0;
+    
+    for (int i = 0; i < num_tests; i++) {
+    
+      const Perft *test = &bench_tests[i];
+    
+      bench_position(&ss[0].pos, test);
+    
+      double start = get_ms();
+      uint64_t num_nodes = perft_threaded(&ss[0], test->depth, opts.threads);
+      double elapsed_ms = get_ms() - start;
+    
+      total_nodes += num_nodes;
+      total_ms += elapsed_ms;
+    
+      if (num_nodes != test->expected)
+        exit_code = 1;
+    
+      printf("%-10s %d %10llu %9.2f ms%s\n",
+             test->label,
+             test->depth,
+             (unsigned long long)num_nodes,
+             elapsed_ms,
+             num_nodes == test->expected ? "" : "  BAD");
+    
+    }
+    
+    ss[0].pos = saved;
+    
+    if (total_nodes != BENCH_SIGNATURE)
+      exit_code = 1;
+    
+    printf("===========================\n");
+    printf("Total time (ms) : %.0f\n", total_ms);
+    printf("Nodes searched  : %llu%s\n", (unsigned long long)total_nodes, total_nodes == BENCH_SIGNATURE ? "" : "  BAD");
+    printf("Nodes/second    : %.0f\n", total_ms > 0.0 ? total_nodes / (total_ms / 1000.0) : 0);
+    
+    /*}}}*/
+  }
+
+  else if (!strcmp(cmd, "perftsuite")) {
+    /*{{{  perft suite*/
+    
+    search_halt();
+    
+    if (n < 2) {
+      printf("perftsuite <file.epd> [depth <max>] [threads <n>] [hash <mb>] [gen legal|pseudo] [bulk on|off]\n");
+      return 0;
+    }
+    
+    int max_depth = PERFTSUITE_MAX_DEPTH;
+    
+    for (int i=2; i < n-1; i++) {
+      if (!strcmp(tokens[i], "depth"))
+        max_depth = atoi(tokens[i+1]);
+    }
+    
+    PerftOpts opts;
+    parse_perft_opts(n, tokens, 2, &opts);
+    
+    perftsuite(sub, max_depth, opts.threads);
+    
+    /*}}}*/
+  }
+
+  else if (!strcmp(cmd, "smp")) {
+    /*{{{  smp bench*/
+    
+    // smp [depth <d>]
+    
+    search_halt();
+    
+    smp_bench(n > 2 && !strcmp(sub, "depth") ? atoi(tokens[2]) : SMP_BENCH_DEPTH);
+    
+    /*}}}*/
+  }
+
+  else if (!strcmp(cmd, "stats")) {
+    /*{{{  stats*/
+    
+    search_halt();
+    
+    print_stats();
+    
+    /*}}}*/
+  }
+
+  else if (!strcmp(cmd, "microbench")) {
+    /*{{{  microbench*/
+    
+    search_halt();
+    
+    microbench();
+    
+    /*}}}*/
+  }
+
+  else if (!strcmp(cmd, "findmagics")) {
+    /*{{{  find magics*/
+    
+    search_halt();
+    
+    find_magics(bishop_attacks, "bishop", bishop_ray_attacks);
+    find_magics(rook_attacks,   "rook",   rook_ray_attacks);
+    
+    /*}}}*/
+  }
+
+  else if (!strcmp(cmd, "go")) {
+    /*{{{  go*/
+    
+    search_halt();
+    search_start(n, tokens);
+    
+    /*}}}*/
+  }
+
+  else if (!strcmp(cmd, "stop")) {
+    /*{{{  stop*/
+    
+    search_halt();
+    
+    /*}}}*/
+  }
+
+  else if (!strcmp(cmd, "ucinewgame")) {
+    /*{{{  ucinewgame*/
+    
+    search_halt();
+    tt_clear();
+    
+    /*}}}*/
+  }
+
+  else if (!strcmp(cmd, "setoption")) {
+    /*{{{  setoption*/
+    
+    // setoption name <name> value <value>
+    
+    search_halt();
+    
+    const char *name  = NULL;
+    const char *value = NULL;
+    
+    for (int i=1; i < n-1; i++) {
+      if (!strcmp(tokens[i], "name"))
+        name = tokens[i+1];
+      else if (!strcmp(tokens[i], "value"))
+        value = tokens[i+1];
+    }
+    
+    if (name && value && !strcasecmp(name, "Hash"))
+      tt_resize(atoi(value));
+    
+    else if (name && value && !strcasecmp(name, "Threads"))
+      search_set_threads(atoi(value));
+    
+    else
+      printf("info string unknown option\n");
+    
+    /*}}}*/
+  }
+
+  else if (!strcmp(cmd, "q") || !strcmp(cmd, "quit")) {
     /*{{{  quit*/
     
+    search_halt();
+    
     return 1;
     
     /*}}}*/
@@ -1540,23 +5721,29 @@ static int uci_tokens(int n, char **tokens) {
 /*}}}*/
 /*{{{  uci_exec*/
 
-static int uci_exec(char *line) {
+// any number of tokens - position commands carry whole games
 
-  char *tokens[UCI_TOKENS];
-  char *token;
+static int uci_exec(char *line) {
 
-  int num_tokens = 0;
+  // +2 so tokens[1] can be read when there is only a command
 
-  token = strtok(line, " \t\n");
+  char **tokens = malloc((strlen(line) / 2 + 2) * sizeof(char *));
+  if (!tokens) {
+    fprintf(stderr, "malloc failed for uci tokens\n");
+    exit(1);
+  }
 
-  while (token != NULL && num_tokens < UCI_TOKENS) {
+  char *save = NULL;
+  int num_tokens = 0;
 
+  for (char *token = strtok_r(line, " \r\t\n", &save); token; token = strtok_r(NULL, " \r\t\n", &save))
     tokens[num_tokens++] = token;
 
-    token = strtok(NULL, " \r\t\n");
-  }
+  const int r = uci_tokens(num_tokens, tokens);
 
-  return uci_tokens(num_tokens, tokens);
+  free(tokens);
+
+  return r;
 
 }
 
@@ -1569,16 +5756,50 @@ static void uci_loop(int argc, char **argv) {
 
   char chunk[UCI_LINE_LENGTH];
 
+  if (argc > 1 && (!strcmp(argv[1], "bench") || !strcmp(argv[1], "perftsuite"))) {
+    /*{{{  naddu bench|perftsuite [options]*/
+    
+    // run the command and exit, for scripts, CI and regression farms
+    
+    size_t len = 0;
+    
+    for (int i=1; i < argc && len < sizeof(chunk) - 1; i++)
+      len += snprintf(chunk + len, sizeof(chunk) - len, "%s ", argv[i]);
+    
+    uci_exec(chunk);
+    
+    return;
+    
+    /*}}}*/
+  }
+
+  // each command line argument runs to completion, go included
+
   for (int i=1; i < argc; i++) {
-    if (uci_exec(argv[i]))
+
+    const int quit = uci_exec(argv[i]);
+
+    search_wait();
+
+    if (quit)
       return;
+
   }
 
-  while (fgets(chunk, sizeof(chunk), stdin) != NULL) {
-    if (uci_exec(chunk))
-      return;
+  // getline grows line as needed, a long game is one long position command
+
+  char *line = NULL;
+  size_t cap = 0;
+
+  while (getline(&line, &cap, stdin) != -1) {
+    if (uci_exec(line))
+      break;
   }
 
+  free(line);
+
+  search_wait();
+
 }
 
 /*}}}*/
@@ -1588,6 +5809,10 @@ static void uci_loop(int argc, char **argv) {
 static void init_once() {
 
  _Static_assert(sizeof(Position) % 64 == 0, "Position size should be multiple of 64");
+#ifndef WIDE_POSITION
+ _Static_assert(sizeof(Position) == 192, "compact Position should be three cache lines");
+#endif
+ _Static_assert(sizeof(Attack) == 32, "Attack size should be 32");
 
   struct timeval start, end;
   gettimeofday(&start, NULL);
@@ -1599,13 +5824,17 @@ static void init_once() {
   init_bishop_attacks();
   init_rook_attacks();
   init_king_attacks();
+  init_lines();
+  init_zobrist();
+
+  tt_resize(TT_DEFAULT_MB);
 
   gettimeofday(&end, NULL);
 
   long ms = (end.tv_sec - start.tv_sec) * 1000 +
             (end.tv_usec - start.tv_usec) / 1000;
 
-  printf("init_once: total time = %ld ms\n", ms);
+  printf("init_once: total time = %ld ms, %s sliders\n", ms, SLIDER_BACKEND);
 
 }
 
@@ -1620,7 +5849,7 @@ int main(int argc, char **argv) {
 
   cleanup();
 
-  return 0;
+  return exit_code;
 
 }
 